@@ -0,0 +1,203 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+
+#include "hash_map.h"
+
+/* Adaptive replacement cache (ARC) of at most 'capacity' elements.
+ *
+ * Elements used once are in list T1, elements used more than once are in
+ * list T2. Keys recently evicted from them are remembered without values in
+ * ghost lists B1 and B2. A miss on a key from B1 means T1 was too small, so
+ * its target size 'p' grows; a miss on a key from B2 shrinks it. Thus the
+ * cache shifts between LRU behavior on scans and LFU-like behavior on hot
+ * keys without tuning.
+ *
+ * Every list is a HashMap kept in order from least to most recently used
+ * by HashMap::move_to_end. Like HashMap, the cache isn't thread-safe. */
+template<class Key, class Value, class Hash = DefaultHash<Key> >
+class ArcCache {
+ public:
+    explicit ArcCache(size_t capacity, const Hash& hasher = Hash())
+            : capacity_(capacity), target_(0), t1_(hasher), t2_(hasher), b1_(hasher), b2_(hasher) {
+        if (capacity == 0) {
+            throw std::invalid_argument("ArcCache capacity must be positive");
+        }
+    }
+
+    // Returns number of cached values.
+    size_t size() const {
+        return t1_.size() + t2_.size();
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    size_t capacity() const {
+        return capacity_;
+    }
+
+    // Returns target size of T1, exposed to see how cache adapts.
+    size_t recency_target() const {
+        return target_;
+    }
+
+    /* Returns pointer to value of 'key' or nullptr, counts use of element.
+     * Pointer is valid until the next change of cache. */
+    const Value* find(const Key& key) {
+        auto it = t1_.find(key);
+        if (it != t1_.end()) {
+            Value value = it->second;
+            t1_.erase(key);
+            t2_.insert({key, value});
+            return &t2_.find(key)->second;
+        }
+
+        it = t2_.find(key);
+        if (it != t2_.end()) {
+            t2_.move_to_end(it);
+            return &it->second;
+        }
+        return nullptr;
+    }
+
+    /* Inserts element or replaces value of 'key', counts use of element.
+     * Usually called after find() missed and the value was loaded. */
+    void insert(const Key& key, const Value& value) {
+        auto it = t1_.find(key);
+        if (it != t1_.end()) {
+            t1_.erase(key);
+            t2_.insert({key, value});
+            return;
+        }
+
+        it = t2_.find(key);
+        if (it != t2_.end()) {
+            it->second = value;
+            t2_.move_to_end(it);
+            return;
+        }
+
+        if (b1_.find(key) != b1_.end()) {
+            // T1 was evicted too early, it gets more room.
+            target_ = std::min(capacity_, target_ + std::max<size_t>(b2_.size() / b1_.size(), 1));
+            replace(false);
+            b1_.erase(key);
+            t2_.insert({key, value});
+            return;
+        }
+
+        if (b2_.find(key) != b2_.end()) {
+            // T2 was evicted too early, it gets more room.
+            size_t delta = std::max<size_t>(b1_.size() / b2_.size(), 1);
+            target_ = target_ > delta ? target_ - delta : 0;
+            replace(true);
+            b2_.erase(key);
+            t2_.insert({key, value});
+            return;
+        }
+
+        size_t recent = t1_.size() + b1_.size();
+        if (recent == capacity_) {
+            if (t1_.size() < capacity_) {
+                erase_first(b1_);
+                replace(false);
+            } else {
+                erase_first(t1_);
+            }
+        } else if (recent + t2_.size() + b2_.size() >= capacity_) {
+            if (recent + t2_.size() + b2_.size() == 2 * capacity_) {
+                erase_first(b2_);
+            }
+            replace(false);
+        }
+        t1_.insert({key, value});
+    }
+
+    // Deletes element and ghost of 'key'.
+    void erase(const Key& key) {
+        t1_.erase(key);
+        t2_.erase(key);
+        b1_.erase(key);
+        b2_.erase(key);
+    }
+
+    void clear() {
+        t1_.clear();
+        t2_.clear();
+        b1_.clear();
+        b2_.clear();
+        target_ = 0;
+    }
+
+    // Returns approximate number of bytes used by lists, see HashMap::memory_usage().
+    size_t memory_usage() const {
+        return sizeof(*this) + t1_.memory_usage() + t2_.memory_usage() + b1_.memory_usage() + b2_.memory_usage();
+    }
+
+    void shrink_to_fit() {
+        t1_.shrink_to_fit();
+        t2_.shrink_to_fit();
+        b1_.shrink_to_fit();
+        b2_.shrink_to_fit();
+    }
+
+    /* Frees about 'bytes' of memory_usage(): drops ghosts first, then evicts
+     * elements from T1 or T2 like replacement does, then shrinks lists.
+     * Evicted elements don't become ghosts. */
+    void evict_memory(size_t bytes) {
+        size_t count = size() + b1_.size() + b2_.size();
+        if (count == 0) {
+            return;
+        }
+        size_t perElement = std::max<size_t>(memory_usage() / count, 1);
+        for (count = std::min(count, (bytes + perElement - 1) / perElement); count > 0; --count) {
+            if (!b1_.empty()) {
+                erase_first(b1_);
+            } else if (!b2_.empty()) {
+                erase_first(b2_);
+            } else if (!t1_.empty() && (t1_.size() > target_ || t2_.empty())) {
+                erase_first(t1_);
+            } else {
+                erase_first(t2_);
+            }
+        }
+        shrink_to_fit();
+    }
+
+ private:
+    struct Ghost {
+    };
+
+    size_t capacity_;
+    size_t target_;  // Target size of T1, 'p' in ARC
+    HashMap<Key, Value, Hash> t1_;  // Used once
+    HashMap<Key, Value, Hash> t2_;  // Used more than once
+    HashMap<Key, Ghost, Hash> b1_;  // Evicted from T1
+    HashMap<Key, Ghost, Hash> b2_;  // Evicted from T2
+
+    template<class Map>
+    static void erase_first(Map& map) {
+        Key key = map.begin()->first;
+        map.erase(key);
+    }
+
+    /* Frees a place in cache by moving the least recently used element of
+     * T1 or T2 to its ghost list. 'inB2' - the key being inserted was in B2. */
+    void replace(bool inB2) {
+        if (size() < capacity_) {
+            // Only after erase(), else ghosts exist only in a full cache.
+            return;
+        }
+        if (!t1_.empty() && (t1_.size() > target_ || (inB2 && t1_.size() == target_))) {
+            b1_.insert({t1_.begin()->first, Ghost()});
+            erase_first(t1_);
+        } else if (!t2_.empty()) {
+            b2_.insert({t2_.begin()->first, Ghost()});
+            erase_first(t2_);
+        }
+    }
+};
@@ -0,0 +1,88 @@
+#pragma once
+
+/* Bit mixer for integer hashing and its batch kernels.
+ * All kernels give the same results as mix_bits(); simd_dispatch.h
+ * chooses one of them for the current CPU. */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "cpu_features.h"
+
+// Mixes bits of 'x' with murmur3 finalizer, every input bit affects every output bit.
+inline uint64_t mix_bits(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// Scalar version of mix_bits_batch().
+inline void mix_bits_batch_scalar(const void* words, size_t count, uint64_t* hashes) {
+    const unsigned char* data = static_cast<const unsigned char*>(words);
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t word;
+        std::memcpy(&word, data + i * 8, 8);
+        hashes[i] = mix_bits(word);
+    }
+}
+
+#ifdef HASH_MAP_X86_64
+
+/* AVX2 has no 64 bit multiplication, so it is made of three 32 bit ones:
+ * x * m = lo(x) * lo(m) + ((hi(x) * lo(m) + lo(x) * hi(m)) << 32). */
+__attribute__((target("avx2")))
+inline __m256i mul64_avx2(__m256i x, __m256i multiplier) {
+    __m256i low = _mm256_mul_epu32(x, multiplier);
+    __m256i cross = _mm256_add_epi64(
+            _mm256_mul_epu32(_mm256_srli_epi64(x, 32), multiplier),
+            _mm256_mul_epu32(x, _mm256_srli_epi64(multiplier, 32)));
+    return _mm256_add_epi64(low, _mm256_slli_epi64(cross, 32));
+}
+
+// mix_bits_batch() for 4 words per instruction.
+__attribute__((target("avx2")))
+inline void mix_bits_batch_avx2(const void* words, size_t count, uint64_t* hashes) {
+    const unsigned char* data = static_cast<const unsigned char*>(words);
+    const __m256i multiplier0 = _mm256_set1_epi64x(static_cast<int64_t>(0xff51afd7ed558ccdULL));
+    const __m256i multiplier1 = _mm256_set1_epi64x(static_cast<int64_t>(0xc4ceb9fe1a85ec53ULL));
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i * 8));
+        x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 33));
+        x = mul64_avx2(x, multiplier0);
+        x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 33));
+        x = mul64_avx2(x, multiplier1);
+        x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 33));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(hashes + i), x);
+    }
+    mix_bits_batch_scalar(data + i * 8, count - i, hashes + i);
+}
+
+/* mix_bits_batch() for 8 words per instruction.
+ * Shifts use the zero-masked form: the plain one makes GCC warn about
+ * an uninitialized register inside its own header. */
+__attribute__((target("avx512f,avx512dq")))
+inline void mix_bits_batch_avx512(const void* words, size_t count, uint64_t* hashes) {
+    const unsigned char* data = static_cast<const unsigned char*>(words);
+    const __m512i multiplier0 = _mm512_set1_epi64(static_cast<int64_t>(0xff51afd7ed558ccdULL));
+    const __m512i multiplier1 = _mm512_set1_epi64(static_cast<int64_t>(0xc4ceb9fe1a85ec53ULL));
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m512i x = _mm512_loadu_si512(data + i * 8);
+        x = _mm512_xor_si512(x, _mm512_maskz_srli_epi64(0xff, x, 33));
+        x = _mm512_mullo_epi64(x, multiplier0);
+        x = _mm512_xor_si512(x, _mm512_maskz_srli_epi64(0xff, x, 33));
+        x = _mm512_mullo_epi64(x, multiplier1);
+        x = _mm512_xor_si512(x, _mm512_maskz_srli_epi64(0xff, x, 33));
+        _mm512_storeu_si512(hashes + i, x);
+    }
+    mix_bits_batch_scalar(data + i * 8, count - i, hashes + i);
+}
+
+#endif
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+#include "concurrent_hash_map.h"
+
+/* ConcurrentHashMap with a per-thread cache of recent lookups, for
+ * read-mostly maps where a thread looks up the same keys again and again.
+ *
+ * Every thread has a direct-mapped cache of 'CacheSize' results of find(),
+ * misses included, shared by all maps of the same type. Keys are split into
+ * stripes by hash, and each stripe has an epoch word like a seqlock: a write
+ * counts itself in the low half before it changes the table, and moves the
+ * version in the high half on when done. A result is cached only if no write
+ * of its stripe was in progress and the epoch didn't change while the table
+ * was read, and it is valid while the epoch stays the same. So a hit costs one
+ * load of a rarely written word, doesn't touch the table, and never returns
+ * a result older than a finished write. Writes must go through this class. */
+template<class Key, class Value, class Hash = DefaultHash<Key>, size_t CacheSize = 256>
+class CachedConcurrentHashMap {
+    static_assert((CacheSize & (CacheSize - 1)) == 0, "CacheSize must be a power of two");
+
+ public:
+    static constexpr size_t kStripes = 64;
+
+    explicit CachedConcurrentHashMap(size_t capacity = 64, const Hash& hasher = Hash())
+            : hasher_(hasher), map_(capacity, hasher), id_(next_id()) {
+    }
+
+    CachedConcurrentHashMap(const CachedConcurrentHashMap&) = delete;
+    CachedConcurrentHashMap& operator=(const CachedConcurrentHashMap&) = delete;
+
+    size_t size() const {
+        return map_.size();
+    }
+
+    bool empty() const {
+        return map_.empty();
+    }
+
+    // Returns value of 'key' if it is in map, from the cache of this thread if possible.
+    std::optional<Value> find(const Key& key) const {
+        size_t hash = hasher_(key);
+        const std::atomic<uint64_t>& epoch = epochs_[stripe(hash)].value;
+        Entry& entry = cache_[hash & (CacheSize - 1)];
+
+        // Cached epochs have no writers, so entries never hit during a write.
+        uint64_t current = epoch.load(std::memory_order_acquire);
+        if (entry.owner == id_ && entry.epoch == current && entry.key == key) {
+            return entry.value;
+        }
+
+        // The table is read with acquire loads, so a write seen there was counted in epoch before the load after.
+        std::optional<Value> value = map_.find(key);
+        if ((current & kWriterMask) == 0 && epoch.load(std::memory_order_acquire) == current) {
+            entry.owner = id_;
+            entry.epoch = current;
+            entry.key = key;
+            entry.value = value;
+        }
+        return value;
+    }
+
+    // Inserts element if 'key' isn't in map. Returns true if element was inserted.
+    bool insert(const Key& key, const Value& value) {
+        StripeWrite write(*this, key);
+        write.changed = map_.insert(key, value);
+        return write.changed;
+    }
+
+    // Inserts element or replaces value of 'key'.
+    void insert_or_assign(const Key& key, const Value& value) {
+        StripeWrite write(*this, key);
+        map_.insert_or_assign(key, value);
+        write.changed = true;
+    }
+
+    // Deletes element with 'key'. Returns true if it was in map.
+    bool erase(const Key& key) {
+        StripeWrite write(*this, key);
+        write.changed = map_.erase(key);
+        return write.changed;
+    }
+
+    /* Returns memory of the map, see ConcurrentHashMap::memory_usage(). Caches
+     * of threads aren't counted, they take CacheSize entries per thread. */
+    size_t memory_usage() const {
+        return sizeof(*this) - sizeof(map_) + map_.memory_usage();
+    }
+
+    // Calls fn(key, value) for every element, see ConcurrentHashMap::for_each.
+    template<class Fn>
+    void for_each(Fn fn) const {
+        map_.for_each(fn);
+    }
+
+ private:
+    struct Entry {
+        uint64_t owner = 0;  // Id of map, 0 if entry is empty
+        uint64_t epoch = 0;
+        Key key;
+        std::optional<Value> value;
+    };
+
+    // Epoch has number of writes in progress in the low half and version in the high one.
+    static constexpr uint64_t kWriter = 1;
+    static constexpr uint64_t kVersionUnit = uint64_t(1) << 32;
+    static constexpr uint64_t kWriterMask = kVersionUnit - 1;
+
+    // Epochs are on separate cache lines, so a write doesn't slow down hits of other stripes.
+    struct alignas(64) Epoch {
+        std::atomic<uint64_t> value{0};
+    };
+
+    /* Counts a write in the epoch of the stripe of 'key' while it exists.
+     * When done, moves version on if the write changed the table, which
+     * makes cached results of the stripe stale in all threads. */
+    class StripeWrite {
+     public:
+        bool changed = false;
+
+        StripeWrite(CachedConcurrentHashMap& map, const Key& key)
+                : epoch_(map.epochs_[stripe(map.hasher_(key))].value) {
+            epoch_.fetch_add(kWriter);
+        }
+
+        StripeWrite(const StripeWrite&) = delete;
+        StripeWrite& operator=(const StripeWrite&) = delete;
+
+        ~StripeWrite() {
+            if (changed) {
+                epoch_.fetch_add(kVersionUnit - kWriter);
+            } else {
+                epoch_.fetch_sub(kWriter);
+            }
+        }
+
+     private:
+        std::atomic<uint64_t>& epoch_;
+    };
+
+    Hash hasher_;
+    ConcurrentHashMap<Key, Value, Hash> map_;
+    uint64_t id_;  // Unique among all maps ever created, so entries of a destroyed map never match
+    Epoch epochs_[kStripes];
+
+    static thread_local Entry cache_[CacheSize];
+
+    static uint64_t next_id() {
+        static std::atomic<uint64_t> lastId(0);
+        return lastId.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    // Stripe takes high bits of hash, cache slot takes low ones.
+    static size_t stripe(size_t hash) {
+        return (hash >> (sizeof(size_t) * 4)) & (kStripes - 1);
+    }
+};
+
+template<class Key, class Value, class Hash, size_t CacheSize>
+thread_local typename CachedConcurrentHashMap<Key, Value, Hash, CacheSize>::Entry
+        CachedConcurrentHashMap<Key, Value, Hash, CacheSize>::cache_[CacheSize];
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "hash_map.h"
+
+/* Hashing and equality for composite keys: std::pair, std::tuple and
+ * structs that list their fields by HASH_MAP_KEY_FIELDS:
+ *
+ *     struct UserKey {
+ *         uint64_t tenant_id;
+ *         uint64_t user_id;
+ *         int bucket;
+ *
+ *         HASH_MAP_KEY_FIELDS(UserKey, tenant_id, user_id, bucket)
+ *     };
+ *
+ * DefaultHash of such keys is transparent, so HashMap can find them by
+ * their fields without building the key: map.find(key_ref(tenant, user, bucket)). */
+
+// Defines key_fields() and equality of struct 'Type' by listed fields.
+#define HASH_MAP_KEY_FIELDS(Type, ...)                                   \
+    auto key_fields() const {                                            \
+        return std::tie(__VA_ARGS__);                                    \
+    }                                                                    \
+    friend bool operator==(const Type& left, const Type& right) {        \
+        return left.key_fields() == right.key_fields();                  \
+    }                                                                    \
+    friend bool operator!=(const Type& left, const Type& right) {        \
+        return !(left == right);                                         \
+    }
+
+// References to fields of a composite key, used to look it up.
+template<class... Fields>
+struct KeyRef {
+    std::tuple<const Fields&...> fields;
+};
+
+// Makes reference to a composite key with fields 'fields'.
+template<class... Fields>
+KeyRef<Fields...> key_ref(const Fields&... fields) {
+    return KeyRef<Fields...>{std::tie(fields...)};
+}
+
+namespace composite_key_impl {
+
+template<class T, class Enable = void>
+struct HasKeyFields : std::false_type {
+};
+
+template<class T>
+struct HasKeyFields<T, decltype(void(std::declval<const T&>().key_fields()))> : std::true_type {
+};
+
+template<class T>
+struct IsTupleOrPair : std::false_type {
+};
+
+template<class... Ts>
+struct IsTupleOrPair<std::tuple<Ts...> > : std::true_type {
+};
+
+template<class First, class Second>
+struct IsTupleOrPair<std::pair<First, Second> > : std::true_type {
+};
+
+// Returns tuple of references to fields of composite key.
+template<class T>
+auto fields_of(const T& key) {
+    if constexpr (HasKeyFields<T>::value) {
+        return key.key_fields();
+    } else {
+        return std::apply([](const auto&... fields) { return std::tie(fields...); }, key);
+    }
+}
+
+template<class... Fields>
+std::tuple<const Fields&...> fields_of(const KeyRef<Fields...>& key) {
+    return key.fields;
+}
+
+template<class T>
+struct IsString : std::integral_constant<bool,
+        std::is_same<T, std::string>::value || std::is_same<T, std::string_view>::value> {
+};
+
+/* Hashes 'field' by hasher of 'KeyField', the type of the same field of key,
+ * so that key_ref("a") finds a key with std::string field "a". Strings are
+ * hashed as std::string_view, which std::hash<std::string> equals, so
+ * key_ref() of a literal or a string_view doesn't build a std::string. */
+template<class KeyField, class Field>
+size_t hash_as(const Field& field) {
+    if constexpr (IsString<KeyField>::value && std::is_convertible<const Field&, std::string_view>::value) {
+        return std::hash<std::string_view>()(std::string_view(field));
+    } else if constexpr (std::is_same<KeyField, Field>::value) {
+        return DefaultHash<KeyField>()(field);
+    } else {
+        static_assert(std::is_constructible<KeyField, const Field&>::value,
+                      "Field of key_ref() doesn't convert to the field of key");
+        return DefaultHash<KeyField>()(KeyField(field));
+    }
+}
+
+template<class KeyFields, class Tuple, size_t... Indices>
+size_t hash_fields(const Tuple& fields, std::index_sequence<Indices...>) {
+    uint64_t hash = sizeof...(Indices);
+    ((hash = mix_bits(hash ^ hash_as<std::decay_t<std::tuple_element_t<Indices, KeyFields> > >(
+            std::get<Indices>(fields)))), ...);
+    return static_cast<size_t>(hash);
+}
+
+/* Combines hashes of all fields, so field order matters. 'KeyFields' is
+ * the type of fields_of() of the key, every field is hashed as its field. */
+template<class KeyFields, class Tuple>
+size_t hash_fields(const Tuple& fields) {
+    static_assert(std::tuple_size<KeyFields>::value == std::tuple_size<Tuple>::value,
+                  "key_ref() must have every field of key");
+    return hash_fields<KeyFields>(fields, std::make_index_sequence<std::tuple_size<Tuple>::value>());
+}
+
+}  // namespace composite_key_impl
+
+// Checks if T is a pair, a tuple or a struct with HASH_MAP_KEY_FIELDS.
+template<class T>
+struct IsCompositeKey : std::integral_constant<bool,
+        composite_key_impl::HasKeyFields<T>::value || composite_key_impl::IsTupleOrPair<T>::value> {
+};
+
+/* Default hasher for composite keys. It hashes fields by hashers of
+ * the fields of T, so a key and key_ref() of its fields (or of values
+ * convertible to them) have the same hash. */
+template<class T>
+struct DefaultHash<T, typename std::enable_if<IsCompositeKey<T>::value>::type> {
+    using is_transparent = void;
+
+    template<class Key>
+    size_t operator()(const Key& key) const {
+        using KeyFields = decltype(composite_key_impl::fields_of(std::declval<const T&>()));
+        return composite_key_impl::hash_fields<KeyFields>(composite_key_impl::fields_of(key));
+    }
+};
+
+// Compares composite key with references to fields.
+template<class T, class... Fields, class = typename std::enable_if<IsCompositeKey<T>::value>::type>
+bool operator==(const T& key, const KeyRef<Fields...>& ref) {
+    return composite_key_impl::fields_of(key) == ref.fields;
+}
+
+template<class T, class... Fields, class = typename std::enable_if<IsCompositeKey<T>::value>::type>
+bool operator==(const KeyRef<Fields...>& ref, const T& key) {
+    return key == ref;
+}
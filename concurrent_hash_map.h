@@ -0,0 +1,623 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "cpu_features.h"
+#include "hash_map.h"
+#include "reader_epochs.h"
+
+/* Concurrent hash map with a lock bit per group of 8 slots.
+ *
+ * Every group has one metadata word: bits of full and deleted slots,
+ * a lock bit, 'moved' and 'frozen' bits and a version. Writers lock the
+ * groups they probe by setting the lock bit, so locks take no extra memory
+ * and writers of different groups never contend. Readers take no locks: they copy
+ * the slots and retry if the metadata word changed meanwhile (a seqlock
+ * per group). Keys and values are kept in atomic words, so they must be
+ * trivially copyable.
+ *
+ * A key is searched in its home group and the following ones up to the
+ * first group with a never used slot. Erase marks the slot deleted. When
+ * 3/4 of the slots are used, the table is rebuilt: all its groups are
+ * frozen, elements are copied to a new table, and old groups are marked
+ * 'moved' so that threads switch to the new table. Writers wait for the
+ * rebuild, readers keep reading frozen groups.
+ *
+ * Old tables are freed by ReaderEpochs when no thread can look at them:
+ * every operation counts itself in a striped reader counter while it uses
+ * a table. That is one atomic add and one subtract per lookup, on a counter
+ * shared with a few threads at most; the groups themselves are only read. */
+template<class Key, class Value, class Hash = DefaultHash<Key> >
+class ConcurrentHashMap {
+    static_assert(std::is_trivially_copyable<Key>::value, "Key must be trivially copyable");
+    static_assert(std::is_trivially_copyable<Value>::value, "Value must be trivially copyable");
+
+ public:
+    static constexpr size_t kGroupSize = 8;
+
+    // Constructs map with room for about 3/4 of capacity elements before growth.
+    explicit ConcurrentHashMap(size_t capacity = 64, const Hash& hasher = Hash())
+            : hasher_(hasher), size_(0) {
+        size_t groups = 1;
+        while (groups * kGroupSize < capacity) {
+            groups *= 2;
+        }
+        table_.store(new Table(groups));
+    }
+
+    ConcurrentHashMap(const ConcurrentHashMap&) = delete;
+    ConcurrentHashMap& operator=(const ConcurrentHashMap&) = delete;
+
+    // Destroys map, must not run concurrently with other operations.
+    ~ConcurrentHashMap() {
+        delete table_.load();
+    }
+
+    // Returns number of elements. Under concurrent writes it is approximate.
+    size_t size() const {
+        return size_.load(std::memory_order_relaxed);
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    // Returns number of bytes used by the current table and old ones that aren't freed yet.
+    size_t memory_usage() const {
+        std::lock_guard<std::mutex> guard(rebuildMutex_);
+        size_t usage = sizeof(*this) + retired_.capacity() * sizeof(retired_[0]);
+        usage += table_memory(table_.load());
+        for (const auto& entry : retired_) {
+            usage += table_memory(entry.second.get());
+        }
+        return usage;
+    }
+
+    // Returns value of 'key' if it is in map.
+    std::optional<Value> find(const Key& key) const {
+        size_t hash = hasher_(key);
+        ReaderEpochs::Guard reader(epochs_);
+        while (true) {
+            bool moved = false;
+            std::optional<Value> result = find_in(table_.load(), key, hash, moved);
+            if (!moved) {
+                return result;
+            }
+        }
+    }
+
+    // Inserts element if 'key' isn't in map. Returns true if element was inserted.
+    bool insert(const Key& key, const Value& value) {
+        bool inserted = false;
+        write(key, [&](Value& current, bool found) {
+            if (found) {
+                return kKeep;
+            }
+            current = value;
+            inserted = true;
+            return kStore;
+        });
+        return inserted;
+    }
+
+    // Inserts element or replaces value of 'key'.
+    void insert_or_assign(const Key& key, const Value& value) {
+        write(key, [&](Value& current, bool /*found*/) {
+            current = value;
+            return kStore;
+        });
+    }
+
+    // Deletes element with 'key'. Returns true if it was in map.
+    bool erase(const Key& key) {
+        bool erased = false;
+        write(key, [&](Value& /*current*/, bool found) {
+            erased = found;
+            return found ? kErase : kKeep;
+        });
+        return erased;
+    }
+
+    /* Adds 'delta' to value of 'key' atomically, missing key counts as Value().
+     * Returns previous value. */
+    Value fetch_add(const Key& key, const Value& delta) {
+        Value previous{};
+        write(key, [&](Value& current, bool /*found*/) {
+            previous = current;
+            current = current + delta;
+            return kStore;
+        });
+        return previous;
+    }
+
+    /* If value of 'key' equals 'expected', replaces it by 'desired' and returns true.
+     * Else returns false and writes current value to 'expected'.
+     * Returns false and leaves 'expected' if 'key' isn't in map. */
+    bool compare_exchange(const Key& key, Value& expected, const Value& desired) {
+        bool exchanged = false;
+        write(key, [&](Value& current, bool found) {
+            if (!found) {
+                return kKeep;
+            }
+            if (!(current == expected)) {
+                expected = current;
+                return kKeep;
+            }
+            current = desired;
+            exchanged = true;
+            return kStore;
+        });
+        return exchanged;
+    }
+
+    /* Calls fn(value) under lock of the element with 'key', inserting
+     * Value() first if it is missing. Returns the new value. */
+    template<class Fn>
+    Value update(const Key& key, Fn fn) {
+        Value result;
+        write(key, [&](Value& current, bool /*found*/) {
+            fn(current);
+            result = current;
+            return kStore;
+        });
+        return result;
+    }
+
+    /* If 'key' is in map, replaces its value by fn(value) under lock.
+     * fn returns std::optional<Value>, std::nullopt deletes the element.
+     * Returns the new value, std::nullopt if there is none. */
+    template<class Fn>
+    std::optional<Value> compute_if_present(const Key& key, Fn fn) {
+        std::optional<Value> result;
+        write(key, [&](Value& current, bool found) {
+            if (!found) {
+                return kKeep;
+            }
+            result = fn(static_cast<const Value&>(current));
+            if (!result) {
+                return kErase;
+            }
+            current = *result;
+            return kStore;
+        });
+        return result;
+    }
+
+    /* Calls fn(key, value) for every element, locking one group at a time.
+     * Elements written concurrently may be missed. */
+    template<class Fn>
+    void for_each(Fn fn) const {
+        ReaderEpochs::Guard reader(epochs_);
+        Table* table = table_.load();
+        for (size_t g = 0; g < table->groupCount; ++g) {
+            Group& group = table->groups[g];
+            uint64_t meta;
+            if (lock_group(group, false, meta) != kLocked) {
+                // Table is rebuilt and can't change anymore.
+                meta = group.meta.load(std::memory_order_acquire);
+                for (size_t slot = 0; slot < kGroupSize; ++slot) {
+                    if (meta & full_bit(slot)) {
+                        fn(group.keys[slot].load(), group.values[slot].load());
+                    }
+                }
+                continue;
+            }
+            for (size_t slot = 0; slot < kGroupSize; ++slot) {
+                if (meta & full_bit(slot)) {
+                    fn(group.keys[slot].load(), group.values[slot].load());
+                }
+            }
+            unlock_group(group, meta, false);
+        }
+    }
+
+ private:
+    // Layout of metadata word.
+    static constexpr size_t kDeletedShift = 8;
+    static constexpr uint64_t kLockBit = uint64_t(1) << 16;
+    static constexpr uint64_t kMovedBit = uint64_t(1) << 17;
+    static constexpr uint64_t kFrozenBit = uint64_t(1) << 18;  // Being copied by rebuild, can't change
+    static constexpr uint64_t kVersionUnit = uint64_t(1) << 19;
+
+    static constexpr size_t kMaxChain = 64;  // Groups a writer may lock at once
+
+    // What a write does with the slot of its key.
+    enum WriteAction {
+        kKeep,
+        kStore,
+        kErase,
+    };
+
+    /* Trivially copyable object in atomic words, so that readers may copy
+     * it while a writer stores it. A copy may be torn, readers use it only
+     * after validation of the group version. A reader that loads a word
+     * stored under a lock sees that lock when it validates the version. */
+    template<class T>
+    class AtomicCopy {
+     public:
+        T load() const {
+            uint64_t words[kWords];
+            for (size_t i = 0; i < kWords; ++i) {
+                words[i] = words_[i].load(std::memory_order_acquire);
+            }
+            T object;
+            std::memcpy(&object, words, sizeof(T));
+            return object;
+        }
+
+        void store(const T& object) {
+            uint64_t words[kWords] = {};
+            std::memcpy(words, &object, sizeof(T));
+            for (size_t i = 0; i < kWords; ++i) {
+                words_[i].store(words[i], std::memory_order_release);
+            }
+        }
+
+     private:
+        static constexpr size_t kWords = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+        std::atomic<uint64_t> words_[kWords];
+    };
+
+    struct Group {
+        std::atomic<uint64_t> meta;
+        AtomicCopy<Key> keys[kGroupSize];
+        AtomicCopy<Value> values[kGroupSize];
+
+        Group() : meta(0) {
+        }
+    };
+
+    struct Table {
+        size_t groupCount;
+        Group* groups;
+        std::atomic<size_t> used;  // Full and deleted slots
+
+        explicit Table(size_t groupCount) :
+                groupCount(groupCount),
+                groups(new Group[groupCount]),
+                used(0) {
+        }
+
+        ~Table() {
+            delete[] groups;
+        }
+
+        size_t capacity() const {
+            return groupCount * kGroupSize;
+        }
+    };
+
+    enum LockResult {
+        kLocked,
+        kMoved,  // Table is rebuilt or being rebuilt, group isn't locked
+        kBusy,  // Try-lock failed
+    };
+
+    enum WriteResult {
+        kDone,
+        kRetry,  // Table was rebuilt or a group was busy
+        kChainTooLong,
+    };
+
+    Hash hasher_;
+    std::atomic<size_t> size_;
+    std::atomic<Table*> table_;  // Uses sequentially consistent order, see ReaderEpochs
+    ReaderEpochs epochs_;
+    mutable std::mutex rebuildMutex_;  // Serializes rebuilds and advances of epochs
+    RetiredList<Table> retired_;  // Old tables, guarded by rebuildMutex_
+
+    static size_t table_memory(const Table* table) {
+        return sizeof(Table) + table->groupCount * sizeof(Group);
+    }
+
+    static uint64_t full_bit(size_t slot) {
+        return uint64_t(1) << slot;
+    }
+
+    static uint64_t deleted_bit(size_t slot) {
+        return uint64_t(1) << (kDeletedShift + slot);
+    }
+
+    // Checks if group has a slot that was never used, probing stops there.
+    static bool has_never_used(uint64_t meta) {
+        return ((meta | (meta >> kDeletedShift)) & 0xff) != 0xff;
+    }
+
+    static void pause() {
+#ifdef HASH_MAP_X86_64
+        _mm_pause();
+#endif
+    }
+
+    static void backoff(size_t spins) {
+        if (spins % 64 == 0) {
+            std::this_thread::yield();
+        } else {
+            pause();
+        }
+    }
+
+    /* Sets lock bit of group, 'meta' gets metadata word before that.
+     * With 'tryOnly' returns kBusy instead of waiting. */
+    static LockResult lock_group(Group& group, bool tryOnly, uint64_t& meta) {
+        for (size_t spins = 1;; ++spins) {
+            meta = group.meta.load(std::memory_order_relaxed);
+            if (meta & (kMovedBit | kFrozenBit)) {
+                return kMoved;
+            }
+            if (!(meta & kLockBit) &&
+                group.meta.compare_exchange_weak(meta, meta | kLockBit, std::memory_order_acquire)) {
+                return kLocked;
+            }
+            if (tryOnly) {
+                return kBusy;
+            }
+            backoff(spins);
+        }
+    }
+
+    /* Unlocks group and sets its slot bits from 'meta'. If group was
+     * changed, its version grows, so readers that copied it meanwhile retry. */
+    static void unlock_group(Group& group, uint64_t meta, bool changed) {
+        uint64_t unlocked = meta & ~kLockBit;
+        if (changed) {
+            unlocked += kVersionUnit;
+        }
+        group.meta.store(unlocked, std::memory_order_release);
+    }
+
+    /* Searches 'key' in table without locks. Sets 'moved' if table was
+     * rebuilt meanwhile, the result is meaningless then. */
+    std::optional<Value> find_in(const Table* table, const Key& key, size_t hash, bool& moved) const {
+        size_t mask = table->groupCount - 1;
+        for (size_t g = hash & mask, step = 0; step < table->groupCount; g = (g + 1) & mask, ++step) {
+            const Group& group = table->groups[g];
+            for (size_t spins = 1;; ++spins) {
+                uint64_t meta = group.meta.load(std::memory_order_acquire);
+                if (meta & kMovedBit) {
+                    moved = true;
+                    return std::nullopt;
+                }
+                if (meta & kLockBit) {
+                    backoff(spins);
+                    continue;
+                }
+
+                // Copies may be torn by a writer, they are used only after validation.
+                bool found = false;
+                Value value;
+                for (size_t slot = 0; slot < kGroupSize && !found; ++slot) {
+                    if ((meta & full_bit(slot)) && group.keys[slot].load() == key) {
+                        value = group.values[slot].load();
+                        found = true;
+                    }
+                }
+
+                if (group.meta.load(std::memory_order_relaxed) != meta) {
+                    continue;
+                }
+                if (found) {
+                    return value;
+                }
+                if (has_never_used(meta)) {
+                    return std::nullopt;
+                }
+                break;
+            }
+        }
+        return std::nullopt;
+    }
+
+    /* Applies fn to the slot of 'key' under locks of its probe chain.
+     * fn(value, found) gets a copy of the value (default one if key is
+     * missing), may change it and returns what to do with the slot. */
+    template<class Fn>
+    void write(const Key& key, Fn fn) {
+        size_t hash = hasher_(key);
+        bool rebuilt = false;
+        {
+            ReaderEpochs::Guard reader(epochs_);
+            while (true) {
+                Table* table = table_.load();
+                WriteResult result = write_in(table, key, hash, fn);
+                if (result == kDone) {
+                    if (table->used.load(std::memory_order_relaxed) * 4 >= table->capacity() * 3) {
+                        rebuild(table, false);
+                        rebuilt = true;
+                    }
+                    break;
+                }
+                if (result == kChainTooLong) {
+                    rebuild(table, true);
+                    rebuilt = true;
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        }
+        if (rebuilt) {
+            // Out of the guard, else this thread would hold back the epoch itself.
+            reclaim();
+        }
+    }
+
+    template<class Fn>
+    WriteResult write_in(Table* table, const Key& key, size_t hash, Fn& fn) {
+        size_t mask = table->groupCount - 1;
+        size_t home = hash & mask;
+
+        // Locked groups and their metadata
+        size_t chain[kMaxChain];
+        uint64_t metas[kMaxChain];
+        size_t length = 0;
+
+        // Slot of key, else the first free slot; 'target' is index in chain, kMaxChain if none.
+        size_t target = kMaxChain;
+        size_t targetSlot = 0;
+        bool found = false;
+
+        auto unlockAll = [&](size_t changed) {
+            for (size_t i = 0; i < length; ++i) {
+                unlock_group(table->groups[chain[i]], metas[i], i == changed);
+            }
+        };
+
+        for (size_t step = 0; step < table->groupCount && !found; ++step) {
+            if (length == kMaxChain) {
+                unlockAll(kMaxChain);
+                return kChainTooLong;
+            }
+
+            // Groups are locked in increasing order, after wrap-around only try-lock avoids deadlocks.
+            size_t g = (home + step) & mask;
+            if (lock_group(table->groups[g], g < home, metas[length]) != kLocked) {
+                unlockAll(kMaxChain);
+                return kRetry;
+            }
+            chain[length] = g;
+            uint64_t meta = metas[length];
+            ++length;
+
+            const Group& group = table->groups[g];
+            for (size_t slot = 0; slot < kGroupSize; ++slot) {
+                if (!(meta & full_bit(slot))) {
+                    if (target == kMaxChain) {
+                        target = length - 1;
+                        targetSlot = slot;
+                    }
+                } else if (group.keys[slot].load() == key) {
+                    target = length - 1;
+                    targetSlot = slot;
+                    found = true;
+                    break;
+                }
+            }
+            if (has_never_used(meta)) {
+                break;
+            }
+        }
+
+        Value value{};
+        if (found) {
+            value = table->groups[chain[target]].values[targetSlot].load();
+        }
+        WriteAction action = fn(value, found);
+
+        if (action == kKeep || (action == kErase && !found)) {
+            unlockAll(kMaxChain);
+            return kDone;
+        }
+        if (target == kMaxChain) {
+            // The whole chain is used, it hardly happens below 3/4 load.
+            unlockAll(kMaxChain);
+            return kChainTooLong;
+        }
+
+        Group& group = table->groups[chain[target]];
+        uint64_t& meta = metas[target];
+        if (action == kErase) {
+            meta = (meta & ~full_bit(targetSlot)) | deleted_bit(targetSlot);
+            size_.fetch_sub(1, std::memory_order_relaxed);
+        } else {
+            group.values[targetSlot].store(value);
+            if (!found) {
+                group.keys[targetSlot].store(key);
+                if (!(meta & deleted_bit(targetSlot))) {
+                    table->used.fetch_add(1, std::memory_order_relaxed);
+                }
+                meta = (meta & ~deleted_bit(targetSlot)) | full_bit(targetSlot);
+                size_.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        unlockAll(target);
+        return kDone;
+    }
+
+    /* Replaces 'table' by a new one if it is still current. The new table
+     * is twice as big if 'grow' or if half of the slots are full, else it
+     * has the same size and no deleted slots. */
+    void rebuild(Table* table, bool grow) {
+        std::lock_guard<std::mutex> guard(rebuildMutex_);
+        if (table_.load(std::memory_order_acquire) != table) {
+            return;
+        }
+
+        /* Waits for writers of every group and freezes it: writers wait
+         * for the new table, readers keep reading. Writers lock groups in
+         * increasing order too, so this can't deadlock. */
+        std::vector<uint64_t> metas(table->groupCount);
+        for (size_t g = 0; g < table->groupCount; ++g) {
+            Group& group = table->groups[g];
+            lock_group(group, false, metas[g]);
+            group.meta.store(metas[g] | kFrozenBit, std::memory_order_relaxed);
+        }
+
+        size_t full = 0;
+        for (uint64_t meta : metas) {
+            full += __builtin_popcountll(meta & 0xff);
+        }
+        if (grow && table->capacity() >= 16 * (full + kMaxChain * kGroupSize)) {
+            // Table is sparse, but a chain is too long: growth won't help.
+            for (size_t g = 0; g < table->groupCount; ++g) {
+                table->groups[g].meta.store(metas[g], std::memory_order_release);
+            }
+            throw std::length_error("Hasher puts too many keys to one place");
+        }
+
+        size_t groupCount = table->groupCount;
+        if (grow || full * 2 >= table->capacity()) {
+            groupCount *= 2;
+        }
+        Table* rebuilt = new Table(groupCount);
+        for (size_t g = 0; g < table->groupCount; ++g) {
+            const Group& group = table->groups[g];
+            for (size_t slot = 0; slot < kGroupSize; ++slot) {
+                if (metas[g] & full_bit(slot)) {
+                    move_to(rebuilt, group.keys[slot].load(), group.values[slot].load());
+                }
+            }
+        }
+
+        retired_.emplace_back(epochs_.current(), table);
+        table_.store(rebuilt);
+        for (size_t g = 0; g < table->groupCount; ++g) {
+            table->groups[g].meta.store((metas[g] | kMovedBit) + kVersionUnit, std::memory_order_release);
+        }
+    }
+
+    // Frees old tables that no thread can look at anymore.
+    void reclaim() {
+        std::lock_guard<std::mutex> guard(rebuildMutex_);
+        epochs_.advance([this](uint64_t epoch) {
+            free_retired(retired_, epoch);
+        });
+    }
+
+    // Inserts element to table that isn't published yet.
+    void move_to(Table* table, const Key& key, const Value& value) {
+        size_t mask = table->groupCount - 1;
+        for (size_t g = hasher_(key) & mask;; g = (g + 1) & mask) {
+            Group& group = table->groups[g];
+            uint64_t meta = group.meta.load(std::memory_order_relaxed);
+            if ((meta & 0xff) == 0xff) {
+                continue;
+            }
+            size_t slot = __builtin_ctzll(~meta & 0xff);
+            group.keys[slot].store(key);
+            group.values[slot].store(value);
+            group.meta.store(meta | full_bit(slot), std::memory_order_relaxed);
+            table->used.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+};
@@ -0,0 +1,461 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+
+#include "hash_map.h"
+
+/* Lock-free hash map from integers to integers for concurrent inserts,
+ * lookups and value updates. Elements are never erased.
+ *
+ * Open addressing with linear probing: a thread claims a slot by CAS of
+ * its key word, then sets the value by CAS. Key kEmptyKey and values
+ * kUnsetValue, kFrozenValue are reserved and can't be stored.
+ *
+ * Growth is cooperative. When half of the slots are claimed, a table twice
+ * as big is linked as 'next', and every writer migrates a chunk of slots
+ * before its operation. Migration freezes a slot by CAS of its value to
+ * kFrozenValue, saving the old value in 'frozenValue'; operations that meet
+ * a frozen slot copy its value to the next table (if nobody did yet) and
+ * continue there. Old tables are freed by the destructor.
+ *
+ * With 'backgroundResize' growth starts earlier, at 3/8 of the slots. The
+ * writer that reaches it only wakes a thread of the map, which allocates
+ * the next table and migrates slots instead of writers, so callers pay
+ * neither for allocation nor for migration. Operations work the same while
+ * it goes on. Only if probing finds no room before the next table is
+ * linked does a writer allocate it itself. ConcurrentHashMap and
+ * ShardedHashMap have no such mode, they rebuild tables on writer threads. */
+template<class Key, class Value, class Hash = DefaultHash<Key> >
+class ConcurrentIntMap {
+    static_assert(std::is_integral<Key>::value, "Key must be integral");
+    static_assert(std::is_integral<Value>::value, "Value must be integral");
+
+ public:
+    static constexpr Key kEmptyKey = std::numeric_limits<Key>::max();
+    static constexpr Value kUnsetValue = std::numeric_limits<Value>::max();
+    static constexpr Value kFrozenValue = std::numeric_limits<Value>::max() - 1;
+
+    // Constructs map with room for about capacity / 2 elements before growth.
+    explicit ConcurrentIntMap(size_t capacity = 64, const Hash& hasher = Hash(), bool backgroundResize = false)
+            : hasher_(hasher), size_(0), background_(backgroundResize), migratorWake_(false), stopping_(false) {
+        size_t tableCapacity = kMinCapacity;
+        while (tableCapacity < capacity) {
+            tableCapacity *= 2;
+        }
+
+        first_ = new Table(tableCapacity);
+        root_.store(first_);
+
+        if (background_) {
+            migrator_ = std::thread([this] { run_migrator(); });
+        }
+    }
+
+    ConcurrentIntMap(const ConcurrentIntMap&) = delete;
+    ConcurrentIntMap& operator=(const ConcurrentIntMap&) = delete;
+
+    // Destroys map and all its tables, must not run concurrently with other operations.
+    ~ConcurrentIntMap() {
+        if (background_) {
+            {
+                std::lock_guard<std::mutex> guard(migratorMutex_);
+                stopping_ = true;
+            }
+            migratorCondition_.notify_one();
+            migrator_.join();
+        }
+
+        Table* table = first_;
+        while (table != nullptr) {
+            Table* next = table->next.load();
+            delete table;
+            table = next;
+        }
+    }
+
+    // Returns number of elements. Under concurrent inserts it is approximate.
+    size_t size() const {
+        return size_.load(std::memory_order_relaxed);
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    /* Returns number of bytes used by all tables, including migrated ones
+     * that are kept until destruction; they take less than the newest one.
+     * Elements are never erased, so there is nothing to reclaim. */
+    size_t memory_usage() const {
+        size_t usage = sizeof(*this);
+        for (const Table* table = first_; table != nullptr; table = table->next.load(std::memory_order_acquire)) {
+            usage += sizeof(Table) + table->capacity * sizeof(Slot);
+        }
+        return usage;
+    }
+
+    // Inserts element if 'key' isn't in map. Returns true if element was inserted.
+    bool insert(Key key, Value value) {
+        check_value(value);
+        Value current = update(key, [value](Value current, Value& desired) {
+            desired = value;
+            return current == kUnsetValue;
+        });
+        return count_if_inserted(current);
+    }
+
+    /* Inserts element if 'key' isn't in map. Returns value of 'key' after
+     * that, e.g. for assigning ids to distinct keys. */
+    Value find_or_insert(Key key, Value value) {
+        check_value(value);
+        Value current = update(key, [value](Value current, Value& desired) {
+            desired = value;
+            return current == kUnsetValue;
+        });
+        return count_if_inserted(current) ? value : current;
+    }
+
+    // Returns value of 'key' if it is in map.
+    std::optional<Value> find(Key key) const {
+        check_key(key);
+        return find_in(root_.load(std::memory_order_acquire), key, hasher_(key));
+    }
+
+    /* Adds 'delta' to value of 'key' atomically, missing key counts as 0.
+     * Sum wraps around like unsigned one. Returns previous value. Throws
+     * std::invalid_argument if the sum is a reserved value, leaving value. */
+    Value fetch_add(Key key, Value delta) {
+        Value current = update(key, [delta](Value current, Value& desired) {
+            using Unsigned = std::make_unsigned_t<Value>;
+            Value base = current == kUnsetValue ? Value() : current;
+            desired = static_cast<Value>(static_cast<Unsigned>(base) + static_cast<Unsigned>(delta));
+            check_value(desired);
+            return true;
+        });
+        if (count_if_inserted(current)) {
+            return Value();
+        }
+        return current;
+    }
+
+    /* If value of 'key' equals 'expected', replaces it by 'desired' and returns true.
+     * Else returns false and writes current value to 'expected'.
+     * Returns false and leaves 'expected' if 'key' isn't in map. */
+    bool compare_exchange(Key key, Value& expected, Value desired) {
+        check_value(expected);
+        check_value(desired);
+        Value current = update(key, [expected, desired](Value current, Value& newValue) {
+            newValue = desired;
+            return current == expected;
+        });
+        if (current == expected) {
+            return true;
+        }
+        if (current != kUnsetValue) {
+            expected = current;
+        }
+        return false;
+    }
+
+ private:
+    static constexpr size_t kMinCapacity = 16;
+    static constexpr size_t kChunkSize = 1024;  // Slots migrated at once
+    static constexpr size_t kMaxProbe = 64;  // Slots checked for a key in one table
+
+    struct Slot {
+        std::atomic<Key> key;
+        std::atomic<Value> value;
+        std::atomic<Value> frozenValue;  // Value before freezing, kUnsetValue if there was none
+
+        Slot() : key(kEmptyKey), value(kUnsetValue), frozenValue(kUnsetValue) {
+        }
+    };
+
+    struct Table {
+        size_t capacity;
+        Slot* slots;
+        std::atomic<size_t> claimed;  // Number of claimed keys
+        std::atomic<Table*> next;  // Table this one migrates to
+        std::atomic<size_t> migrateCursor;  // Next chunk to migrate
+        std::atomic<size_t> migratedChunks;
+
+        explicit Table(size_t capacity) :
+                capacity(capacity),
+                slots(new Slot[capacity]),
+                claimed(0),
+                next(nullptr),
+                migrateCursor(0),
+                migratedChunks(0) {
+        }
+
+        ~Table() {
+            delete[] slots;
+        }
+
+        size_t chunks() const {
+            return (capacity + kChunkSize - 1) / kChunkSize;
+        }
+
+        bool migrated() const {
+            return migratedChunks.load(std::memory_order_acquire) == chunks();
+        }
+    };
+
+    Hash hasher_;
+    std::atomic<size_t> size_;
+    std::atomic<Table*> root_;  // The oldest table that isn't migrated yet
+    Table* first_;  // The oldest table, tables are linked by 'next'
+
+    // Background migration
+    bool background_;
+    std::thread migrator_;
+    std::mutex migratorMutex_;
+    std::condition_variable migratorCondition_;
+    bool migratorWake_;  // A table was linked since the thread looked, guarded by migratorMutex_
+    bool stopping_;  // Guarded by migratorMutex_
+
+    static void check_key(Key key) {
+        if (key == kEmptyKey) {
+            throw std::invalid_argument("Key is reserved by ConcurrentIntMap");
+        }
+    }
+
+    static void check_value(Value value) {
+        if (value == kUnsetValue || value == kFrozenValue) {
+            throw std::invalid_argument("Value is reserved by ConcurrentIntMap");
+        }
+    }
+
+    // Counts new element if update() saw no value. Returns true in this case.
+    bool count_if_inserted(Value current) {
+        if (current != kUnsetValue) {
+            return false;
+        }
+        size_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /* Applies 'update' to value of 'key'. update(current, desired) gets
+     * current value (kUnsetValue if key is missing), sets the new one and
+     * returns false to leave current. Returns current value. */
+    template<class Update>
+    Value update(Key key, Update update) {
+        check_key(key);
+        return update_from(root_.load(std::memory_order_acquire), key, hasher_(key), update);
+    }
+
+    // Does update() starting from 'table'.
+    template<class Update>
+    Value update_from(Table* table, Key key, size_t hash, Update& update) {
+        while (true) {
+            if (!background_) {
+                help_migrate(table);
+            }
+
+            Slot* slot = claim(table, key, hash);
+            if (slot == nullptr) {
+                table = grow(table);
+                continue;
+            }
+
+            Value current = slot->value.load(std::memory_order_acquire);
+            while (current != kFrozenValue) {
+                Value desired;
+                if (!update(current, desired)) {
+                    return current;
+                }
+                if (slot->value.compare_exchange_weak(current, desired)) {
+                    return current;
+                }
+            }
+
+            copy_frozen(table, slot, key, hash);
+            table = table->next.load(std::memory_order_acquire);
+        }
+    }
+
+    /* Returns slot with 'key' in 'table', claims a free one if key is missing.
+     * Returns nullptr if neither is within kMaxProbe slots. */
+    Slot* claim(Table* table, Key key, size_t hash) {
+        size_t mask = table->capacity - 1;
+        size_t probes = std::min(kMaxProbe, table->capacity);
+        for (size_t i = hash & mask, step = 0; step < probes; i = (i + 1) & mask, ++step) {
+            Slot& slot = table->slots[i];
+            Key current = slot.key.load(std::memory_order_acquire);
+            if (current == kEmptyKey) {
+                if (slot.key.compare_exchange_strong(current, key)) {
+                    size_t claimed = table->claimed.fetch_add(1) + 1;
+                    if (!background_ && claimed >= grow_threshold(table)) {
+                        grow(table);
+                    } else if (background_ && claimed == grow_threshold(table)) {
+                        wake_migrator();
+                    }
+                    return &slot;
+                }
+            }
+            if (current == key) {
+                return &slot;
+            }
+        }
+        return nullptr;
+    }
+
+    // Returns value of 'key' from 'table' or newer tables.
+    std::optional<Value> find_in(const Table* table, Key key, size_t hash) const {
+        size_t mask = table->capacity - 1;
+        size_t probes = std::min(kMaxProbe, table->capacity);
+        for (size_t i = hash & mask, step = 0; step < probes; i = (i + 1) & mask, ++step) {
+            const Slot& slot = table->slots[i];
+            Key current = slot.key.load(std::memory_order_acquire);
+            if (current != key && current != kEmptyKey) {
+                continue;
+            }
+
+            Value value = slot.value.load(std::memory_order_acquire);
+            if (value != kFrozenValue) {
+                return current == key && value != kUnsetValue ? std::optional<Value>(value) : std::nullopt;
+            }
+
+            // Newer table has the newest value; if it has no value yet, the frozen one is the newest.
+            std::optional<Value> result = find_in(table->next.load(std::memory_order_acquire), key, hash);
+            Value frozen = slot.frozenValue.load(std::memory_order_acquire);
+            if (result || current != key || frozen == kUnsetValue) {
+                return result;
+            }
+            return frozen;
+        }
+
+        const Table* next = table->next.load(std::memory_order_acquire);
+        return next != nullptr ? find_in(next, key, hash) : std::nullopt;
+    }
+
+    // Links the next table to 'table' if there is none yet, returns it.
+    Table* grow(Table* table) {
+        Table* next = table->next.load(std::memory_order_acquire);
+        if (next != nullptr) {
+            return next;
+        }
+
+        Table* created = new Table(table->capacity * 2);
+        if (table->next.compare_exchange_strong(next, created)) {
+            if (background_) {
+                wake_migrator();
+            }
+            return created;
+        }
+        delete created;
+        return next;
+    }
+
+    // Returns number of claimed slots at which 'table' starts to grow.
+    size_t grow_threshold(const Table* table) const {
+        return background_ ? table->capacity / 8 * 3 : table->capacity / 2;
+    }
+
+    void wake_migrator() {
+        {
+            std::lock_guard<std::mutex> guard(migratorMutex_);
+            migratorWake_ = true;
+        }
+        migratorCondition_.notify_one();
+    }
+
+    /* Body of background thread: links the next table to tables that
+     * reached the threshold and migrates tables that have 'next'. */
+    void run_migrator() {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(migratorMutex_);
+                migratorCondition_.wait(lock, [this] { return migratorWake_ || stopping_; });
+                if (stopping_) {
+                    return;
+                }
+                migratorWake_ = false;
+            }
+
+            Table* table = root_.load(std::memory_order_acquire);
+            while (true) {
+                Table* next = table->next.load(std::memory_order_acquire);
+                if (next == nullptr) {
+                    if (table->claimed.load() < grow_threshold(table)) {
+                        break;
+                    }
+                    next = grow(table);
+                }
+                while (table->migrateCursor.load(std::memory_order_relaxed) < table->chunks()) {
+                    help_migrate(table);
+                }
+                table = next;
+            }
+        }
+    }
+
+    // Migrates one chunk of 'table' if it is being migrated.
+    void help_migrate(Table* table) {
+        if (table->next.load(std::memory_order_acquire) == nullptr) {
+            return;
+        }
+
+        size_t chunk = table->migrateCursor.fetch_add(1);
+        if (chunk >= table->chunks()) {
+            return;
+        }
+
+        migrate_chunk(table, chunk);
+        if (table->migratedChunks.fetch_add(1, std::memory_order_acq_rel) + 1 == table->chunks()) {
+            advance_root();
+        }
+    }
+
+    // Freezes slots of the chunk and copies their values to the next table.
+    void migrate_chunk(Table* table, size_t chunk) {
+        size_t end = std::min(table->capacity, (chunk + 1) * kChunkSize);
+        for (size_t i = chunk * kChunkSize; i < end; ++i) {
+            Slot& slot = table->slots[i];
+            Value current = slot.value.load(std::memory_order_acquire);
+            while (true) {
+                // Only the owner of the chunk writes 'frozenValue', before freezing.
+                slot.frozenValue.store(current, std::memory_order_relaxed);
+                if (slot.value.compare_exchange_weak(current, kFrozenValue)) {
+                    break;
+                }
+            }
+
+            if (current != kUnsetValue) {
+                Key key = slot.key.load(std::memory_order_acquire);
+                copy_frozen(table, &slot, key, hasher_(key));
+            }
+        }
+    }
+
+    // Inserts value of frozen slot to the next table if key isn't there yet.
+    void copy_frozen(Table* table, Slot* slot, Key key, size_t hash) {
+        Value frozen = slot->frozenValue.load(std::memory_order_acquire);
+        if (frozen == kUnsetValue) {
+            return;
+        }
+
+        auto insertFrozen = [frozen](Value current, Value& desired) {
+            desired = frozen;
+            return current == kUnsetValue;
+        };
+        update_from(table->next.load(std::memory_order_acquire), key, hash, insertFrozen);
+    }
+
+    // Moves root past tables that are fully migrated.
+    void advance_root() {
+        Table* root = root_.load(std::memory_order_acquire);
+        while (root->migrated()) {
+            Table* next = root->next.load(std::memory_order_acquire);
+            root_.compare_exchange_strong(root, next);
+            root = root_.load(std::memory_order_acquire);
+        }
+    }
+};
@@ -0,0 +1,36 @@
+#pragma once
+
+/* Detection of CPU features used by hashers and SIMD kernels.
+ * Features are checked by CPUID once, on first call of cpu_features(),
+ * so a function chosen by them stays the same for the whole process. */
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HASH_MAP_X86_64 1
+#include <immintrin.h>
+#endif
+
+struct CpuFeatures {
+    bool sse42;  // CRC32C instruction
+    bool aes;  // AES-NI rounds
+    bool avx2;
+    bool avx512;  // AVX-512 F and DQ
+};
+
+// Asks CPUID which features are available.
+inline CpuFeatures detect_cpu_features() {
+    CpuFeatures features = {false, false, false, false};
+#ifdef HASH_MAP_X86_64
+    __builtin_cpu_init();
+    features.sse42 = __builtin_cpu_supports("sse4.2");
+    features.aes = __builtin_cpu_supports("aes");
+    features.avx2 = __builtin_cpu_supports("avx2");
+    features.avx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq");
+#endif
+    return features;
+}
+
+// Returns features of current CPU, detected once.
+inline const CpuFeatures& cpu_features() {
+    static const CpuFeatures features = detect_cpu_features();
+    return features;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "bit_mix.h"
+#include "cpu_features.h"
+#include "hash_map.h"
+
+/* Fixed-length binary key such as UUID (16 bytes), SHA-1 (20 bytes) or
+ * SHA-256 (32 bytes). Bytes are stored aligned and padded with zeros to
+ * a multiple of 16, so keys are compared by whole vector registers.
+ * DefaultHash mixes the first 16 bytes: hashes are uniform, but UUIDs of
+ * versions 1, 6 and 7 start with a timestamp whose low bytes barely vary. */
+template<size_t Size>
+class Digest {
+ public:
+    static constexpr size_t kStorageSize = (Size + 15) / 16 * 16;  // Size with padding
+    static constexpr size_t kAlignment = kStorageSize >= 32 ? 32 : 16;
+
+    static_assert(Size > 0, "Digest can't be empty");
+
+    // Constructs digest of zero bytes.
+    Digest() : bytes_() {
+    }
+
+    // Constructs digest from 'Size' bytes at 'data'.
+    explicit Digest(const void* data) : bytes_() {
+        std::memcpy(bytes_, data, Size);
+    }
+
+    // Returns pointer to 'Size' bytes of digest.
+    const unsigned char* data() const {
+        return bytes_;
+    }
+
+    static constexpr size_t size() {
+        return Size;
+    }
+
+    bool operator==(const Digest& other) const {
+#if defined(HASH_MAP_X86_64) && defined(__AVX2__)
+        if constexpr (kStorageSize % 32 == 0) {
+            __m256i equal = _mm256_set1_epi8(-1);
+            for (size_t i = 0; i < kStorageSize; i += 32) {
+                __m256i left = _mm256_load_si256(reinterpret_cast<const __m256i*>(bytes_ + i));
+                __m256i right = _mm256_load_si256(reinterpret_cast<const __m256i*>(other.bytes_ + i));
+                equal = _mm256_and_si256(equal, _mm256_cmpeq_epi8(left, right));
+            }
+            return _mm256_movemask_epi8(equal) == -1;
+        }
+#endif
+#ifdef HASH_MAP_X86_64
+        __m128i equal = _mm_set1_epi8(-1);
+        for (size_t i = 0; i < kStorageSize; i += 16) {
+            __m128i left = _mm_load_si128(reinterpret_cast<const __m128i*>(bytes_ + i));
+            __m128i right = _mm_load_si128(reinterpret_cast<const __m128i*>(other.bytes_ + i));
+            equal = _mm_and_si128(equal, _mm_cmpeq_epi8(left, right));
+        }
+        return _mm_movemask_epi8(equal) == 0xffff;
+#else
+        return std::memcmp(bytes_, other.bytes_, kStorageSize) == 0;
+#endif
+    }
+
+    bool operator!=(const Digest& other) const {
+        return !(*this == other);
+    }
+
+ private:
+    alignas(kAlignment) unsigned char bytes_[kStorageSize];  // Digest and zero padding
+};
+
+using Uuid = Digest<16>;
+using Sha1Digest = Digest<20>;
+using Sha256Digest = Digest<32>;
+
+// Hasher for digests: mixed bits of their first 16 bytes.
+template<size_t Size>
+struct DefaultHash<Digest<Size> > {
+    size_t operator()(const Digest<Size>& key) const {
+        // Storage is at least 16 bytes, short digests are padded by zeros.
+        uint64_t words[2];
+        std::memcpy(words, key.data(), sizeof(words));
+        return static_cast<size_t>(mix_bits(words[0] ^ mix_bits(words[1])));
+    }
+};
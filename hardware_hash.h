@@ -0,0 +1,385 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#include "bit_mix.h"
+#include "cpu_features.h"
+
+/* Hashers built on CRC32C (SSE 4.2) and AES-NI instructions.
+ * Supported keys: integers, pointers and other types without padding
+ * (32, 64 and 128 bit keys have their own paths), std::string and
+ * std::string_view. Instruction set is chosen by CPUID once per process;
+ * on CPUs without it a portable mixer is used.
+ * Batch operations of HashMap hash strings of equal length four at a time,
+ * interleaving their dependency chains.
+ * Example: HashMap<uint64_t, int, Crc32cHash<uint64_t> >. */
+
+namespace hardware_hash_impl {
+
+const uint64_t kSeed0 = 0x9e3779b97f4a7c15ULL;
+const uint64_t kSeed1 = 0xbf58476d1ce4e5b9ULL;
+
+// Reads up to 8 bytes to the lower bytes of a word.
+inline uint64_t load_word(const unsigned char* data, size_t size) {
+    uint64_t word = 0;
+    std::memcpy(&word, data, size);
+    return word;
+}
+
+// Portable hashing, used when CPU lacks the instructions.
+struct Portable {
+    static uint64_t u64(uint64_t x) {
+        return mix_bits(x ^ kSeed0);
+    }
+
+    static uint64_t u128(uint64_t low, uint64_t high) {
+        return mix_bits(mix_bits(low ^ kSeed0) ^ high);
+    }
+
+    static uint64_t bytes(const unsigned char* data, size_t size) {
+        uint64_t hash = mix_bits(size ^ kSeed1);
+        for (; size >= 8; data += 8, size -= 8) {
+            hash = mix_bits(hash ^ load_word(data, 8));
+        }
+        if (size > 0) {
+            hash = mix_bits(hash ^ load_word(data, size));
+        }
+        return hash;
+    }
+
+    static void bytes_x4(const unsigned char* const* data, size_t size, uint64_t* hashes) {
+        for (size_t i = 0; i < 4; ++i) {
+            hashes[i] = bytes(data[i], size);
+        }
+    }
+};
+
+#ifdef HASH_MAP_X86_64
+
+/* CRC32C is a bijection on 32 bit words, so lower bits that choose the slot
+ * are spread well. Upper half is a CRC of rotated key. */
+__attribute__((target("sse4.2")))
+inline uint64_t crc32c_u64(uint64_t x) {
+    uint64_t low = _mm_crc32_u64(static_cast<uint32_t>(kSeed0), x);
+    uint64_t high = _mm_crc32_u64(static_cast<uint32_t>(kSeed1), (x << 32) | (x >> 32));
+    return (high << 32) | low;
+}
+
+__attribute__((target("sse4.2")))
+inline uint64_t crc32c_u128(uint64_t low, uint64_t high) {
+    uint64_t crc0 = _mm_crc32_u64(_mm_crc32_u64(static_cast<uint32_t>(kSeed0), low), high);
+    uint64_t crc1 = _mm_crc32_u64(_mm_crc32_u64(static_cast<uint32_t>(kSeed1), high), low);
+    return (crc1 << 32) | crc0;
+}
+
+__attribute__((target("sse4.2")))
+inline uint64_t crc32c_bytes(const unsigned char* data, size_t size) {
+    uint64_t crc = _mm_crc32_u64(static_cast<uint32_t>(kSeed0), size);
+    for (; size >= 8; data += 8, size -= 8) {
+        crc = _mm_crc32_u64(crc, load_word(data, 8));
+    }
+    if (size > 0) {
+        crc = _mm_crc32_u64(crc, load_word(data, size));
+    }
+    return (_mm_crc32_u64(static_cast<uint32_t>(kSeed1), crc) << 32) | crc;
+}
+
+// crc32c_bytes() of 4 strings of equal size, their CRC chains run in parallel.
+__attribute__((target("sse4.2")))
+inline void crc32c_bytes_x4(const unsigned char* const* data, size_t size, uint64_t* hashes) {
+    uint64_t crc[4];
+    for (size_t i = 0; i < 4; ++i) {
+        crc[i] = _mm_crc32_u64(static_cast<uint32_t>(kSeed0), size);
+    }
+    size_t offset = 0;
+    for (; offset + 8 <= size; offset += 8) {
+        for (size_t i = 0; i < 4; ++i) {
+            crc[i] = _mm_crc32_u64(crc[i], load_word(data[i] + offset, 8));
+        }
+    }
+    for (size_t i = 0; i < 4; ++i) {
+        if (offset < size) {
+            crc[i] = _mm_crc32_u64(crc[i], load_word(data[i] + offset, size - offset));
+        }
+        hashes[i] = (_mm_crc32_u64(static_cast<uint32_t>(kSeed1), crc[i]) << 32) | crc[i];
+    }
+}
+
+// Two AES rounds give full diffusion of a 128 bit block.
+__attribute__((target("aes,sse4.2")))
+inline uint64_t aes_mix(__m128i block) {
+    const __m128i key0 = _mm_set_epi64x(kSeed1, kSeed0);
+    const __m128i key1 = _mm_set_epi64x(kSeed0, kSeed1);
+    block = _mm_aesenc_si128(_mm_xor_si128(block, key0), key1);
+    block = _mm_aesenc_si128(block, key0);
+    return static_cast<uint64_t>(_mm_cvtsi128_si64(block));
+}
+
+__attribute__((target("aes,sse4.2")))
+inline uint64_t aes_u64(uint64_t x) {
+    return aes_mix(_mm_set_epi64x(0, static_cast<int64_t>(x)));
+}
+
+__attribute__((target("aes,sse4.2")))
+inline uint64_t aes_u128(uint64_t low, uint64_t high) {
+    return aes_mix(_mm_set_epi64x(static_cast<int64_t>(high), static_cast<int64_t>(low)));
+}
+
+__attribute__((target("aes,sse4.2")))
+inline uint64_t aes_bytes(const unsigned char* data, size_t size) {
+    const __m128i key = _mm_set_epi64x(kSeed0, kSeed1);
+    __m128i state = _mm_set_epi64x(0, static_cast<int64_t>(size));
+    for (; size >= 16; data += 16, size -= 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+        state = _mm_aesenc_si128(_mm_xor_si128(state, block), key);
+    }
+    if (size > 0) {
+        unsigned char tail[16] = {};
+        std::memcpy(tail, data, size);
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tail));
+        state = _mm_aesenc_si128(_mm_xor_si128(state, block), key);
+    }
+    return aes_mix(state);
+}
+
+// aes_bytes() of 4 strings of equal size, their AES chains run in parallel.
+__attribute__((target("aes,sse4.2")))
+inline void aes_bytes_x4(const unsigned char* const* data, size_t size, uint64_t* hashes) {
+    const __m128i key = _mm_set_epi64x(kSeed0, kSeed1);
+    __m128i state[4];
+    for (size_t i = 0; i < 4; ++i) {
+        state[i] = _mm_set_epi64x(0, static_cast<int64_t>(size));
+    }
+    size_t offset = 0;
+    for (; offset + 16 <= size; offset += 16) {
+        for (size_t i = 0; i < 4; ++i) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data[i] + offset));
+            state[i] = _mm_aesenc_si128(_mm_xor_si128(state[i], block), key);
+        }
+    }
+    for (size_t i = 0; i < 4; ++i) {
+        if (offset < size) {
+            unsigned char tail[16] = {};
+            std::memcpy(tail, data[i] + offset, size - offset);
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tail));
+            state[i] = _mm_aesenc_si128(_mm_xor_si128(state[i], block), key);
+        }
+        hashes[i] = aes_mix(state[i]);
+    }
+}
+
+#endif
+
+// CRC32C hashing, portable when SSE 4.2 is unavailable.
+struct Crc32c {
+    static bool available() {
+        return cpu_features().sse42;
+    }
+
+    static uint64_t u64(uint64_t x) {
+#ifdef HASH_MAP_X86_64
+        if (available()) {
+            return crc32c_u64(x);
+        }
+#endif
+        return Portable::u64(x);
+    }
+
+    static uint64_t u128(uint64_t low, uint64_t high) {
+#ifdef HASH_MAP_X86_64
+        if (available()) {
+            return crc32c_u128(low, high);
+        }
+#endif
+        return Portable::u128(low, high);
+    }
+
+    static uint64_t bytes(const unsigned char* data, size_t size) {
+#ifdef HASH_MAP_X86_64
+        if (available()) {
+            return crc32c_bytes(data, size);
+        }
+#endif
+        return Portable::bytes(data, size);
+    }
+
+    static void bytes_x4(const unsigned char* const* data, size_t size, uint64_t* hashes) {
+#ifdef HASH_MAP_X86_64
+        if (available()) {
+            crc32c_bytes_x4(data, size, hashes);
+            return;
+        }
+#endif
+        Portable::bytes_x4(data, size, hashes);
+    }
+};
+
+// AES-NI hashing, portable when AES-NI is unavailable.
+struct Aes {
+    static bool available() {
+        const CpuFeatures& features = cpu_features();
+        return features.aes && features.sse42;
+    }
+
+    static uint64_t u64(uint64_t x) {
+#ifdef HASH_MAP_X86_64
+        if (available()) {
+            return aes_u64(x);
+        }
+#endif
+        return Portable::u64(x);
+    }
+
+    static uint64_t u128(uint64_t low, uint64_t high) {
+#ifdef HASH_MAP_X86_64
+        if (available()) {
+            return aes_u128(low, high);
+        }
+#endif
+        return Portable::u128(low, high);
+    }
+
+    static uint64_t bytes(const unsigned char* data, size_t size) {
+#ifdef HASH_MAP_X86_64
+        if (available()) {
+            return aes_bytes(data, size);
+        }
+#endif
+        return Portable::bytes(data, size);
+    }
+
+    static void bytes_x4(const unsigned char* const* data, size_t size, uint64_t* hashes) {
+#ifdef HASH_MAP_X86_64
+        if (available()) {
+            aes_bytes_x4(data, size, hashes);
+            return;
+        }
+#endif
+        Portable::bytes_x4(data, size, hashes);
+    }
+};
+
+// The fastest of the above: AES-NI, then CRC32C, then portable.
+struct Best {
+    static uint64_t u64(uint64_t x) {
+        return Aes::available() ? Aes::u64(x) : Crc32c::u64(x);
+    }
+
+    static uint64_t u128(uint64_t low, uint64_t high) {
+        return Aes::available() ? Aes::u128(low, high) : Crc32c::u128(low, high);
+    }
+
+    static uint64_t bytes(const unsigned char* data, size_t size) {
+        return Aes::available() ? Aes::bytes(data, size) : Crc32c::bytes(data, size);
+    }
+
+    static void bytes_x4(const unsigned char* const* data, size_t size, uint64_t* hashes) {
+        if (Aes::available()) {
+            Aes::bytes_x4(data, size, hashes);
+        } else {
+            Crc32c::bytes_x4(data, size, hashes);
+        }
+    }
+};
+
+// Hashes a key without padding by its object representation.
+template<class Algorithm, class T>
+uint64_t hash_key(const T& key) {
+    static_assert(std::has_unique_object_representations<T>::value,
+                  "Key must not contain padding or floating point numbers");
+
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(&key);
+    if constexpr (sizeof(T) <= 8) {
+        return Algorithm::u64(load_word(data, sizeof(T)));
+    } else if constexpr (sizeof(T) == 16) {
+        return Algorithm::u128(load_word(data, 8), load_word(data + 8, 8));
+    } else {
+        return Algorithm::bytes(data, sizeof(T));
+    }
+}
+
+template<class Algorithm>
+uint64_t hash_key(std::string_view key) {
+    return Algorithm::bytes(reinterpret_cast<const unsigned char*>(key.data()), key.size());
+}
+
+template<class Algorithm>
+uint64_t hash_key(const std::string& key) {
+    return hash_key<Algorithm>(std::string_view(key));
+}
+
+/* Writes hashes of 'count' keys to 'hashes'. Runs of 4 strings of equal
+ * length are hashed together. */
+template<class Algorithm, class T>
+void hash_key_batch(const T* keys, size_t count, size_t* hashes) {
+    size_t i = 0;
+    if constexpr (std::is_same<T, std::string>::value || std::is_same<T, std::string_view>::value) {
+        for (; i + 4 <= count; i += 4) {
+            size_t size = keys[i].size();
+            if (keys[i + 1].size() != size || keys[i + 2].size() != size ||
+                keys[i + 3].size() != size) {
+
+                for (size_t j = i; j < i + 4; ++j) {
+                    hashes[j] = static_cast<size_t>(hash_key<Algorithm>(keys[j]));
+                }
+                continue;
+            }
+
+            const unsigned char* data[4];
+            uint64_t result[4];
+            for (size_t j = 0; j < 4; ++j) {
+                data[j] = reinterpret_cast<const unsigned char*>(keys[i + j].data());
+            }
+            Algorithm::bytes_x4(data, size, result);
+            for (size_t j = 0; j < 4; ++j) {
+                hashes[i + j] = static_cast<size_t>(result[j]);
+            }
+        }
+    }
+    for (; i < count; ++i) {
+        hashes[i] = static_cast<size_t>(hash_key<Algorithm>(keys[i]));
+    }
+}
+
+}  // namespace hardware_hash_impl
+
+// Hasher based on CRC32C instruction.
+template<class T>
+struct Crc32cHash {
+    size_t operator()(const T& key) const {
+        return static_cast<size_t>(hardware_hash_impl::hash_key<hardware_hash_impl::Crc32c>(key));
+    }
+
+    void hash_batch(const T* keys, size_t count, size_t* hashes) const {
+        hardware_hash_impl::hash_key_batch<hardware_hash_impl::Crc32c>(keys, count, hashes);
+    }
+};
+
+// Hasher based on AES-NI rounds.
+template<class T>
+struct AesHash {
+    size_t operator()(const T& key) const {
+        return static_cast<size_t>(hardware_hash_impl::hash_key<hardware_hash_impl::Aes>(key));
+    }
+
+    void hash_batch(const T* keys, size_t count, size_t* hashes) const {
+        hardware_hash_impl::hash_key_batch<hardware_hash_impl::Aes>(keys, count, hashes);
+    }
+};
+
+// Hasher that uses AES-NI or CRC32C, whichever this CPU has.
+template<class T>
+struct HardwareHash {
+    size_t operator()(const T& key) const {
+        return static_cast<size_t>(hardware_hash_impl::hash_key<hardware_hash_impl::Best>(key));
+    }
+
+    void hash_batch(const T* keys, size_t count, size_t* hashes) const {
+        hardware_hash_impl::hash_key_batch<hardware_hash_impl::Best>(keys, count, hashes);
+    }
+};
@@ -1,14 +1,226 @@
+#pragma once
+
 #include <algorithm>
 #include <cstddef>
+#include <cstdint>
+#include <cstdlib>
 #include <functional>
 #include <initializer_list>
+#include <new>
 #include <stdexcept>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include "simd_dispatch.h"
+
+/* Array of slots for open addressing tables.
+ * Memory is taken from calloc, so slots are already zero and never memset:
+ * big blocks come from fresh anonymous mappings whose pages are not touched
+ * until the table writes to them. The first slot is aligned to a cache line.
+ * T must be a type for which all-zero bytes is a valid value (e.g. pointer). */
+template<class T>
+class SlotArray {
+ public:
+    static constexpr size_t kAlignment = 64;  // Cache line size
+
+    SlotArray() : raw_(nullptr), data_(nullptr), size_(0) {
+    }
+
+    // Allocates 'size' zero slots.
+    explicit SlotArray(size_t size) : SlotArray() {
+        if (size > (SIZE_MAX - kAlignment) / sizeof(T)) {
+            throw std::bad_alloc();
+        }
+
+        raw_ = std::calloc(size * sizeof(T) + kAlignment, 1);
+        if (raw_ == nullptr) {
+            throw std::bad_alloc();
+        }
+
+        uintptr_t address = reinterpret_cast<uintptr_t>(raw_);
+        address = (address + kAlignment - 1) & ~(uintptr_t(kAlignment) - 1);
+        data_ = reinterpret_cast<T*>(address);
+        size_ = size;
+    }
+
+    SlotArray(const SlotArray&) = delete;
+    SlotArray& operator=(const SlotArray&) = delete;
+
+    ~SlotArray() {
+        std::free(raw_);
+    }
+
+    // Replaces contents by 'size' zero slots. Old memory is freed.
+    void reset(size_t size) {
+        SlotArray other(size);
+        swap(other);
+    }
+
+    void swap(SlotArray& other) {
+        std::swap(raw_, other.raw_);
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+    }
+
+    T& operator[](size_t i) {
+        return data_[i];
+    }
+
+    const T& operator[](size_t i) const {
+        return data_[i];
+    }
+
+    T* data() {
+        return data_;
+    }
+
+    const T* data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+ private:
+    void* raw_;  // Pointer returned by calloc
+    T* data_;  // Aligned beginning of slots
+    size_t size_;  // Number of slots
+};
+
+// Hints CPU to start loading memory at 'address'.
+inline void prefetch(const void* address) {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(address);
+#else
+    (void)address;
+#endif
+}
+
+/* Default hasher for HashMap. Same as std::hash for most types.
+ * std::hash of integers and pointers is usually identity: aligned addresses
+ * and offsets have zero low bits, and these bits choose the slot. So such
+ * keys are mixed by mix_bits.
+ * Hashers may have method hash_batch(keys, count, hashes), which HashMap
+ * batch operations use instead of hashing keys one by one. */
+template<class T, class Enable = void>
+struct DefaultHash : std::hash<T> {
+};
+
+// Default hasher for pointer keys.
+template<class T>
+struct DefaultHash<T*> {
+    size_t operator()(T* key) const {
+        return static_cast<size_t>(mix_bits(reinterpret_cast<uintptr_t>(key)));
+    }
+
+    // Hashes 'count' keys by vector instructions.
+    void hash_batch(T* const* keys, size_t count, size_t* hashes) const {
+        if constexpr (sizeof(T*) == 8 && sizeof(size_t) == 8) {
+            mix_bits_batch(keys, count, reinterpret_cast<uint64_t*>(hashes));
+        } else {
+            for (size_t i = 0; i < count; ++i) {
+                hashes[i] = (*this)(keys[i]);
+            }
+        }
+    }
+};
+
+// Default hasher for integral and enum keys.
+template<class T>
+struct DefaultHash<T, typename std::enable_if<std::is_integral<T>::value ||
+                                              std::is_enum<T>::value>::type> {
+    size_t operator()(T key) const {
+        return static_cast<size_t>(mix_bits(static_cast<uint64_t>(key)));
+    }
+
+    // Hashes 'count' keys, by vector instructions for 64 bit keys.
+    void hash_batch(const T* keys, size_t count, size_t* hashes) const {
+        if constexpr (sizeof(T) == 8 && sizeof(size_t) == 8) {
+            mix_bits_batch(keys, count, reinterpret_cast<uint64_t*>(hashes));
+        } else {
+            for (size_t i = 0; i < count; ++i) {
+                hashes[i] = (*this)(keys[i]);
+            }
+        }
+    }
+};
+
+// Checks if hasher H has method hash_batch() for keys of type K.
+template<class H, class K, class Enable = void>
+struct HasHashBatch : std::false_type {
+};
+
+template<class H, class K>
+struct HasHashBatch<H, K, decltype(void(std::declval<const H&>().hash_batch(
+        std::declval<const K*>(), size_t(), std::declval<size_t*>())))> : std::true_type {
+};
+
+/* Probing policies of HashMap: the order in which slots are checked.
+ * home() is the first slot of a key, next() is the slot after 'pos'
+ * when 'step' slots have been checked. Capacity is a power of two.
+ * Linear policies (next slot is pos + 1) delete by shifting elements back,
+ * others leave tombstones which are dropped on resize. */
+
+// Checks slots one by one starting from hash modulo capacity.
+struct LinearProbing {
+    static constexpr bool kLinear = true;
+
+    static size_t home(size_t hash, size_t capacity) {
+        return hash & (capacity - 1);
+    }
+
+    static size_t next(size_t pos, size_t /*step*/, size_t capacity) {
+        return (pos + 1) & (capacity - 1);
+    }
+};
+
+/* Linear probing from the beginning of a bucket of 8 slots, which is one
+ * cache line as slot arrays are cache line aligned. A key is searched
+ * in its whole bucket before going to the next one. */
+struct BucketizedProbing {
+    static constexpr bool kLinear = true;
+    static constexpr size_t kBucketSize = 8;
+
+    static size_t home(size_t hash, size_t capacity) {
+        return hash & (capacity - 1) & ~(kBucketSize - 1);
+    }
+
+    static size_t next(size_t pos, size_t /*step*/, size_t capacity) {
+        return (pos + 1) & (capacity - 1);
+    }
+};
+
+/* Triangular probing: offsets from home slot are 1, 3, 6, 10, ...
+ * It visits every slot of a power of two table and breaks up clusters
+ * that linear probing forms with weak hashers. */
+struct TriangularProbing {
+    static constexpr bool kLinear = false;
+
+    static size_t home(size_t hash, size_t capacity) {
+        return hash & (capacity - 1);
+    }
+
+    static size_t next(size_t pos, size_t step, size_t capacity) {
+        return (pos + step) & (capacity - 1);
+    }
+};
+
+// Number of slots checked to find stored keys, see HashMap::probe_stats().
+struct ProbeStats {
+    double average;
+    size_t max;
+};
+
 /* Hash map with open addressing.
  * When size is more than 3/4 of capacity, it doubles.
+ * Capacity is always a power of two, so slot is taken from low bits of hash.
+ * Order of checked slots is set by Probing policy (see LinearProbing).
+ * Optionally number of checked slots is limited (see set_probe_limit()).
  * All elements are located in linked list for iterating over them. */
-template<class KeyType, class ValueType, class Hash = std::hash<KeyType> >
+template<class KeyType, class ValueType, class Hash = DefaultHash<KeyType>,
+         class Probing = LinearProbing>
 class HashMap {
  private:
     /* All elements are located in linked list.
@@ -42,22 +254,29 @@ class HashMap {
         }
     }
 
-    // Copy constructor.
-    HashMap(const HashMap& other, const Hash& hasher = Hash()) : hasher_(hasher) {
+    /* Copy constructor. Hasher is copied too, so elements keep their
+     * positions and nothing is rehashed. */
+    HashMap(const HashMap& other) : hasher_(other.hasher_) {
         init();
+        copy_from(other);
+    }
+
+    // Copies elements of 'other' into hash map with another hasher.
+    HashMap(const HashMap& other, const Hash& hasher) : hasher_(hasher) {
+        init();
+        probeLimit_ = other.probeLimit_;
 
         for (auto it = other.begin(); it != other.end(); ++it) {
             insert(*it);
         }
     }
 
-    // Assignment operator.
+    // Assignment operator. Copies hasher and layout of 'other'.
     HashMap& operator=(const HashMap& other) {
         if (&other != this) {
             delete_all();
-            for (auto it = other.begin(); it != other.end(); ++it) {
-                insert(*it);
-            }
+            hasher_ = other.hasher_;
+            copy_from(other);
         }
         return *this;
     }
@@ -83,25 +302,32 @@ class HashMap {
         const KeyType& key = keyValue.first;
         const ValueType& value = keyValue.second;
 
-        size_t pos = find_pos(key);
+        size_t hash = hasher_(key);
+        size_t pos = find_pos(key, hash);
 
-        if (storage[pos] == nullptr) {
-            storage[pos] = create_item(key, value);
-            storage[pos]->pos = pos;
-            ++size_;
-
-            resize_if_need();
+        if (!is_found(pos) && find_in_stash(key, hash) == nullptr) {
+            emplace_at(pos, key, value, hash);
         }
     }
 
     // Deletes element by O(1) amortized
     void erase(const KeyType& key) {
-        size_t pos = find_pos(key);
+        size_t hash = hasher_(key);
+        size_t pos = find_pos(key, hash);
 
-        if (storage[pos] != nullptr) {
-            delete_item(storage[pos]);
+        if (!is_found(pos)) {
+            erase_from_stash(key, hash);
+            return;
+        }
+
+        delete_item(storage[pos]);
+        --size_;
+
+        if constexpr (!Probing::kLinear) {
+            storage[pos] = tombstone();
+            ++tombstones_;
+        } else {
             storage[pos] = nullptr;
-            --size_;
 
             size_t nextPos = find_next(pos);
             while (storage[nextPos] != nullptr) {
@@ -112,8 +338,6 @@ class HashMap {
                 pos = nextPos;
                 nextPos = find_next(pos);
             }
-
-            resize_if_need();
         }
     }
 
@@ -122,6 +346,8 @@ class HashMap {
      private:
         Item* item;
 
+        friend class HashMap;
+
      public:
         iterator() = default;
 
@@ -219,54 +445,119 @@ class HashMap {
      * else returns end().
      * */
     iterator find(const KeyType& key) {
-        size_t pos = find_pos(key);
-
-        if (storage[pos] == nullptr) {
-            return iterator(_end);
-        }
-
-        return iterator(storage[pos]);
+        Item* item = find_item(key, hasher_(key));
+        return iterator(item == nullptr ? _end : item);
     }
 
     // Constant version of find().
     const_iterator find(const KeyType& key) const {
-        size_t pos = find_pos(key);
+        Item* item = find_item(key, hasher_(key));
+        return const_iterator(item == nullptr ? _end : item);
+    }
 
-        if (storage[pos] == nullptr) {
-            return const_iterator(_end);
-        }
+    /* Finds key equal to 'key' of another type, e.g. by references to fields
+     * of a composite key. Hasher must be transparent (have 'is_transparent')
+     * and hash 'key' the same way as equal KeyType. */
+    template<class K, class H = Hash, class = typename H::is_transparent>
+    iterator find(const K& key) {
+        Item* item = find_item(key, hasher_(key));
+        return iterator(item == nullptr ? _end : item);
+    }
 
-        return const_iterator(storage[pos]);
+    // Constant version of heterogeneous find().
+    template<class K, class H = Hash, class = typename H::is_transparent>
+    const_iterator find(const K& key) const {
+        Item* item = find_item(key, hasher_(key));
+        return const_iterator(item == nullptr ? _end : item);
     }
 
     /* If 'key' is in hash map - returns it's reference,
      * else creates new element with key 'key' and returns it's reference.
      * */
     ValueType& operator[](const KeyType& key) {
-        size_t pos = find_pos(key);
+        size_t hash = hasher_(key);
+        size_t pos = find_pos(key, hash);
 
-        if (storage[pos] == nullptr) {
-            storage[pos] = create_item(key, ValueType());
-            storage[pos]->pos = pos;
-            ++size_;
-
-            resize_if_need();
-
-            pos = find_pos(key);
+        if (is_found(pos)) {
+            return storage[pos]->keyValue.second;
         }
 
-        return storage[pos]->keyValue.second;
+        Item* item = find_in_stash(key, hash);
+        if (item == nullptr) {
+            item = emplace_at(pos, key, ValueType(), hash);
+        }
+        return item->keyValue.second;
     }
 
     // Similar to operator[] but throws an exception if 'key' isn't in hash map.
     const ValueType& at(const KeyType& key) const {
-        size_t pos = find_pos(key);
+        const Item* item = find_item(key, hasher_(key));
 
-        if (storage[pos] == nullptr) {
+        if (item == nullptr) {
             throw std::out_of_range("No such key in the hash table");
         }
 
-        return storage[pos]->keyValue.second;
+        return item->keyValue.second;
+    }
+
+    // Heterogeneous version of at(), see heterogeneous find().
+    template<class K, class H = Hash, class = typename H::is_transparent>
+    const ValueType& at(const K& key) const {
+        const Item* item = find_item(key, hasher_(key));
+
+        if (item == nullptr) {
+            throw std::out_of_range("No such key in the hash table");
+        }
+
+        return item->keyValue.second;
+    }
+
+    /* Finds 'count' keys at once, results[i] is find(keys[i]).
+     * All keys are hashed first (by vector instructions if hasher can), then
+     * their slots and items are prefetched, so memory loads overlap. */
+    void find_batch(const KeyType* keys, size_t count, iterator* results) {
+        Item* items[kBatchSize];
+        for (size_t done = 0; done < count; done += kBatchSize) {
+            size_t batch = std::min(kBatchSize, count - done);
+            find_items(keys + done, batch, items);
+
+            for (size_t i = 0; i < batch; ++i) {
+                results[done + i] = iterator(items[i] == nullptr ? _end : items[i]);
+            }
+        }
+    }
+
+    // Constant version of find_batch().
+    void find_batch(const KeyType* keys, size_t count, const_iterator* results) const {
+        Item* items[kBatchSize];
+        for (size_t done = 0; done < count; done += kBatchSize) {
+            size_t batch = std::min(kBatchSize, count - done);
+            find_items(keys + done, batch, items);
+
+            for (size_t i = 0; i < batch; ++i) {
+                results[done + i] = const_iterator(items[i] == nullptr ? _end : items[i]);
+            }
+        }
+    }
+
+    /* Inserts pairs (keys[i], values[i]) like insert() does.
+     * Keys are hashed and prefetched in batches like in find_batch(). */
+    void insert_batch(const KeyType* keys, const ValueType* values, size_t count) {
+        size_t hashes[kBatchSize];
+        for (size_t done = 0; done < count; done += kBatchSize) {
+            size_t batch = std::min(kBatchSize, count - done);
+            hash_keys(keys + done, batch, hashes);
+            prefetch_slots(hashes, batch);
+
+            for (size_t i = 0; i < batch; ++i) {
+                const KeyType& key = keys[done + i];
+                size_t pos = find_pos(key, hashes[i]);
+
+                if (!is_found(pos) && find_in_stash(key, hashes[i]) == nullptr) {
+                    emplace_at(pos, key, values[done + i], hashes[i]);
+                }
+            }
+        }
     }
 
     // Deletes all elements from hash map.
@@ -274,11 +565,103 @@ class HashMap {
         Item* item = _begin;
         while (item != _end) {
             Item* next = item->next;
-            storage[item->pos] = nullptr;
+            if (item->pos != kStashPos) {
+                storage[item->pos] = nullptr;
+            }
             delete_item(item);
             item = next;
         }
         size_ = 0;
+        stash_.clear();
+
+        if (tombstones_ > 0) {
+            storage.reset(capacity_);
+            tombstones_ = 0;
+        }
+    }
+
+    /* Returns approximate number of bytes used by hash map: slots, list
+     * items and stash. Memory owned by keys and values isn't counted. */
+    size_t memory_usage() const {
+        return sizeof(*this) + capacity_ * sizeof(Item*) + (size_ + 1) * sizeof(Item) +
+               stash_.capacity() * sizeof(Item*);
+    }
+
+    /* Decreases capacity to the least one that fits the elements by O(n),
+     * e.g. after many of them were erased. */
+    void shrink_to_fit() {
+        size_t newCapacity = 1;
+        while (size_ * 4 >= newCapacity * 3) {
+            newCapacity *= 2;
+        }
+        if (newCapacity < capacity_ || tombstones_ > 0) {
+            resize(newCapacity);
+        }
+        stash_.shrink_to_fit();
+    }
+
+    /* Moves element to the end of iteration order by O(1). New elements
+     * are added to the end too, so caches can keep elements ordered from
+     * least to most recently used. */
+    void move_to_end(iterator it) {
+        Item* item = it.item;
+        if (item->next == _end) {
+            return;
+        }
+
+        if (item == _begin) {
+            _begin = item->next;
+        }
+        item->move_before(_end);
+    }
+
+    /* Limits number of slots checked for a key by 'limit' (0 - no limit)
+     * and rebuilds hash map by O(n). Elements that don't fit in the limit
+     * go to a stash of at most kStashCapacity elements that is searched
+     * after the slots. When the stash is full, capacity doubles. So a search
+     * checks at most limit + kStashCapacity elements.
+     * Only if hasher maps too many keys to the same slots, stash may grow
+     * beyond kStashCapacity instead of growing the table endlessly. */
+    void set_probe_limit(size_t limit) {
+        probeLimit_ = limit;
+        resize(capacity_);
+    }
+
+    // Returns limit of checked slots, 0 if there is no limit.
+    size_t probe_limit() const {
+        return probeLimit_;
+    }
+
+    static constexpr size_t kStashCapacity = 8;  // Elements in stash before growth
+
+    /* Returns average and maximum number of slots checked to find a stored
+     * key by O(n * probe length). Meant for comparing probing policies.
+     * Element in stash counts as probe limit plus its place in stash. */
+    ProbeStats probe_stats() const {
+        ProbeStats stats = {0, 0};
+        if (size_ == 0) {
+            return stats;
+        }
+
+        size_t total = 0;
+        for (size_t i = 0; i < stash_.size(); ++i) {
+            total += probeLimit_ + i + 1;
+            stats.max = std::max(stats.max, probeLimit_ + i + 1);
+        }
+        for (const Item* item = _begin; item != _end; item = item->next) {
+            if (item->pos == kStashPos) {
+                continue;
+            }
+
+            size_t length = 1;
+            for (size_t i = get_hash(item->hash); i != item->pos; ++length) {
+                i = Probing::next(i, length, capacity_);
+            }
+            total += length;
+            stats.max = std::max(stats.max, length);
+        }
+        stats.average = static_cast<double>(total) / size_;
+        return stats;
     }
 
     // Destroys hash map and frees the memory
@@ -290,6 +673,8 @@ class HashMap {
  private:
     size_t size_;  // size
     size_t capacity_;  // capacity
+    size_t tombstones_;  // Slots of deleted elements, only for non-linear probing
+    size_t probeLimit_;  // Max slots checked for a key, 0 if unlimited
     Hash hasher_;
 
     /* All elements are located in linked list
@@ -322,13 +707,15 @@ class HashMap {
         std::pair<const KeyType, ValueType> keyValue;  // Pair of key and value
         Item* prev;  // Pointer to the previous element
         Item* next;  // Pointer to the next element
-        size_t pos;  // Position of element in 'storage' vector
+        size_t pos;  // Position of element in 'storage' array or kStashPos
+        size_t hash;  // Hash of key, so resize and probing don't call hasher
 
-        // Constructs Item from key, value and pointers to it's neighbors.
-        Item(const KeyType& key, const ValueType& value, Item* prev, Item* next) :
+        // Constructs Item from key, value, it's hash and pointers to it's neighbors.
+        Item(const KeyType& key, const ValueType& value, size_t hash, Item* prev, Item* next) :
                 keyValue({key, value}),
                 prev(prev),
-                next(next) {
+                next(next),
+                hash(hash) {
 
             connect();
         }
@@ -345,46 +732,142 @@ class HashMap {
         ~Item() {
             disconnect();
         }
+
+        // Moves item to the list position before 'other'.
+        void move_before(Item* other) {
+            disconnect();
+            prev = other->prev;
+            next = other;
+            connect();
+        }
     };
 
     Item* _begin;  // First element in linked list
     Item* _end;  // Last element in linked list
 
     // Pointers to linked list elements and the main storage array for hash map.
-    std::vector<Item*> storage;
+    SlotArray<Item*> storage;
+
+    static constexpr size_t kStashPos = SIZE_MAX;  // 'pos' of elements in stash
+
+    // Elements that don't fit in probe limit.
+    std::vector<Item*> stash_;
 
     // Initialize properties for empty hash map by O(1).
     void init() {
         size_ = 0;
         capacity_ = 1;
+        tombstones_ = 0;
+        probeLimit_ = 0;
 
-        storage.assign(1, nullptr);
+        storage.reset(1);
 
         _end = new Item(nullptr, nullptr);
         _begin = _end;
     }
 
-    // Changes capacity to newCapacity by O(n) where n is number of elements.
+    /* Changes capacity to newCapacity by O(n) where n is number of elements.
+     * Capacity grows further while elements overflow the stash. */
     void resize(size_t newCapacity) {
-        storage.assign(newCapacity, nullptr);
+        while (!rebuild(newCapacity)) {
+            newCapacity *= 2;
+        }
+    }
+
+    /* Places all elements in storage of newCapacity slots.
+     * Returns false if stash overflows and the table may grow. */
+    bool rebuild(size_t newCapacity) {
+        bool mayGrow = may_grow_for_stash(newCapacity, size_);
+
+        storage.reset(newCapacity);
 
         capacity_ = newCapacity;
         size_ = 0;
+        tombstones_ = 0;
+        stash_.clear();
 
         for (Item* item = _begin; item != _end; item = item->next) {
             insert_item(item);
         }
+        return stash_.size() <= kStashCapacity || !mayGrow;
+    }
+
+    /* Checks if table of 'capacity' slots with 'size' elements may grow
+     * because of stash overflow. In a table this sparse the stash only
+     * overflows because of a weak hasher, and growth wouldn't help. */
+    static bool may_grow_for_stash(size_t capacity, size_t size) {
+        return capacity < 16 * (size + kStashCapacity);
     }
 
-    // Get hash modulo capacity.
-    size_t get_hash(const KeyType& key) const {
-        return hasher_(key) % capacity_;
+    // Get home slot of hash.
+    size_t get_hash(size_t hash) const {
+        return Probing::home(hash, capacity_);
     }
 
-    // If size is more than 3/4 of capacity, increases it.
+    /* If size with tombstones is more than 3/4 of capacity, increases it.
+     * If most of them are tombstones, rebuilds with the same capacity. */
     void resize_if_need() {
-        if (size_ * 4 >= capacity_ * 3) {  // if size_/capacity_ >= 3/4
-            resize(capacity_ * 2);
+        if ((size_ + tombstones_) * 4 >= capacity_ * 3) {  // if used/capacity_ >= 3/4
+            resize(size_ * 8 >= capacity_ * 3 ? capacity_ * 2 : capacity_);
+        }
+    }
+
+    // Marks slot of deleted element for non-linear probing.
+    static Item* tombstone() {
+        alignas(Item) static char marker;
+        return reinterpret_cast<Item*>(&marker);
+    }
+
+    // Checks if find_pos() returned position of an element.
+    bool is_found(size_t pos) const {
+        return pos != capacity_ && !is_free(storage[pos]);
+    }
+
+    // Checks if slot holds no element.
+    static bool is_free(const Item* item) {
+        if constexpr (Probing::kLinear) {
+            return item == nullptr;
+        } else {
+            return item == nullptr || item == tombstone();
+        }
+    }
+
+    static constexpr size_t kBatchSize = 16;  // Keys hashed at once in batch operations
+
+    // Writes hashes of 'count' keys to 'hashes'.
+    void hash_keys(const KeyType* keys, size_t count, size_t* hashes) const {
+        if constexpr (HasHashBatch<Hash, KeyType>::value) {
+            hasher_.hash_batch(keys, count, hashes);
+        } else {
+            for (size_t i = 0; i < count; ++i) {
+                hashes[i] = hasher_(keys[i]);
+            }
+        }
+    }
+
+    // Prefetches home slots of 'count' hashes.
+    void prefetch_slots(const size_t* hashes, size_t count) const {
+        for (size_t i = 0; i < count; ++i) {
+            prefetch(&storage[get_hash(hashes[i])]);
+        }
+    }
+
+    /* Writes find_item() of 'count' keys (at most kBatchSize) to 'items'.
+     * Home slots are prefetched, then the items they point to. */
+    void find_items(const KeyType* keys, size_t count, Item** items) const {
+        size_t hashes[kBatchSize];
+        hash_keys(keys, count, hashes);
+        prefetch_slots(hashes, count);
+
+        for (size_t i = 0; i < count; ++i) {
+            const Item* item = storage[get_hash(hashes[i])];
+            if (!is_free(item)) {
+                prefetch(item);
+            }
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            items[i] = find_item(keys[i], hashes[i]);
         }
     }
 
@@ -407,47 +890,163 @@ class HashMap {
     }
 
     /* If 'key' is in storage, returns its position.
-     * If 'key' is not in storage, returns first free position in storage. */
-    size_t find_pos(const KeyType& key) const {
-        size_t hash = get_hash(key);
-
-        for (size_t i = hash;; i = cyclic_inc(i)) {
-            if (storage[i] == nullptr ||
-                storage[i]->keyValue.first == key) {
+     * If 'key' is not in storage, returns first free position in storage
+     * (the first tombstone on the way, if any), or capacity_ if there is
+     * no free position within probe limit. Stash is not searched.
+     * 'key' may have another type comparable with KeyType. */
+    template<class K>
+    size_t find_pos(const K& key, size_t hash) const {
+        size_t freePos = capacity_;
+        for (size_t i = get_hash(hash), step = 1;; i = Probing::next(i, step++, capacity_)) {
+            const Item* item = storage[i];
+            if (item == nullptr) {
+                return freePos != capacity_ ? freePos : i;
+            }
 
+            if (!Probing::kLinear && item == tombstone()) {
+                if (freePos == capacity_) {
+                    freePos = i;
+                }
+            } else if (item->hash == hash && item->keyValue.first == key) {
                 return i;
             }
+
+            if (step == probeLimit_) {
+                return freePos;
+            }
         }
     }
 
+    // Returns element with key 'key' from storage or stash, nullptr if there is none.
+    template<class K>
+    Item* find_item(const K& key, size_t hash) const {
+        size_t pos = find_pos(key, hash);
+        if (is_found(pos)) {
+            return storage[pos];
+        }
+        return find_in_stash(key, hash);
+    }
+
+    // Returns element with key 'key' from stash, nullptr if there is none.
+    template<class K>
+    Item* find_in_stash(const K& key, size_t hash) const {
+        for (Item* item : stash_) {
+            if (item->hash == hash && item->keyValue.first == key) {
+                return item;
+            }
+        }
+        return nullptr;
+    }
+
+    // Deletes element with key 'key' from stash if it is there.
+    void erase_from_stash(const KeyType& key, size_t hash) {
+        Item* item = find_in_stash(key, hash);
+        if (item == nullptr) {
+            return;
+        }
+
+        *std::find(stash_.begin(), stash_.end(), item) = stash_.back();
+        stash_.pop_back();
+        delete_item(item);
+        --size_;
+    }
+
     /* Returns first free position in storage after 'pos'.
-     * This function is used for deleting elements from hash map. */
+     * This function is used for deleting elements from hash map
+     * with linear probing. */
     size_t find_next(size_t pos) {
         for (size_t i = cyclic_inc(pos);; i = cyclic_inc(i)) {
             if (storage[i] == nullptr) {
                 return i;
             }
 
-            if (!is_in_range(get_hash(storage[i]->keyValue.first), cyclic_inc(pos), i)) {
+            if (!is_in_range(get_hash(storage[i]->hash), cyclic_inc(pos), i)) {
                 return i;
             }
         }
     }
 
-    // Inserts item in hash map.
+    /* Inserts item in hash map. Keys of items are distinct, so the first
+     * free position is taken and keys are never compared.
+     * If there is none within probe limit, item goes to stash. */
     void insert_item(Item* item) {
-        size_t pos = find_pos(item->keyValue.first);
+        ++size_;
+
+        size_t pos = get_hash(item->hash);
+        if (probeLimit_ == 0 && Probing::kLinear) {
+            pos = find_null_slot(storage.data(), pos, capacity_);
+        } else {
+            for (size_t step = 1; storage[pos] != nullptr; ++step) {
+                if (step == probeLimit_) {
+                    stash_.push_back(item);
+                    item->pos = kStashPos;
+                    return;
+                }
+                pos = Probing::next(pos, step, capacity_);
+            }
+        }
+
+        storage[pos] = item;
+        item->pos = pos;
+    }
 
-        if (storage[pos] == nullptr) {
+    /* Copies all elements of 'other' to the same positions by O(n).
+     * Hash map must be empty and have the same hasher as 'other'. */
+    void copy_from(const HashMap& other) {
+        storage.reset(other.capacity_);
+        capacity_ = other.capacity_;
+        probeLimit_ = other.probeLimit_;
+
+        for (Item* item = other._begin; item != other._end; item = item->next) {
+            Item* copy = create_item(item->keyValue.first, item->keyValue.second, item->hash);
+            copy->pos = item->pos;
+            if (item->pos == kStashPos) {
+                stash_.push_back(copy);
+            } else {
+                storage[item->pos] = copy;
+            }
+        }
+        size_ = other.size_;
+
+        // Probe sequences pass through tombstones, so they are copied too.
+        if (other.tombstones_ > 0) {
+            for (size_t i = 0; i < capacity_; ++i) {
+                if (other.storage[i] == tombstone()) {
+                    storage[i] = tombstone();
+                }
+            }
+            tombstones_ = other.tombstones_;
+        }
+    }
+
+    /* Creates item at free position 'pos' returned by find_pos(),
+     * or in stash if it is capacity_. */
+    Item* emplace_at(size_t pos, const KeyType& key, const ValueType& value, size_t hash) {
+        Item* item = create_item(key, value, hash);
+        ++size_;
+
+        if (pos == capacity_) {
+            stash_.push_back(item);
+            item->pos = kStashPos;
+            if (stash_.size() > kStashCapacity && may_grow_for_stash(capacity_, size_)) {
+                resize(capacity_ * 2);
+                return item;
+            }
+        } else {
+            if (storage[pos] != nullptr) {
+                --tombstones_;
+            }
             storage[pos] = item;
-            storage[pos]->pos = pos;
-            ++size_;
+            item->pos = pos;
         }
+
+        resize_if_need();
+        return item;
     }
 
     // Creates new Item object and changes '_begin' property if need.
-    Item* create_item(const KeyType& key, const ValueType& value) {
-        Item* item = new Item(key, value, _end->prev, _end);
+    Item* create_item(const KeyType& key, const ValueType& value, size_t hash) {
+        Item* item = new Item(key, value, hash, _end->prev, _end);
         if (item->prev == nullptr) {
             _begin = item;
         }
@@ -468,15 +1067,15 @@ class HashMap {
 
     // Deletes all elements from hash map.
     void delete_all() {
-        for (size_t i = 0; i < storage.size(); ++i) {
-            delete_item(storage[i]);
+        while (_begin != _end) {
+            delete_item(_begin);
         }
 
-        storage.assign(1, nullptr);
-
-        _begin = _end;
+        storage.reset(1);
+        stash_.clear();
 
         capacity_ = 1;
         size_ = 0;
+        tombstones_ = 0;
     }
 };
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "hash_map.h"
+
+/* Cache that loads missing values by a loader function, with refresh-ahead.
+ *
+ * A value is fresh for 'softTtl' after loading. After that, get() returns
+ * the stale value at once and queues a refresh to a pool of worker threads.
+ * After 'hardTtl' the value isn't returned anymore and get() waits for
+ * a load. Concurrent loads of one key are done once: callers wait for
+ * the load in progress, be it theirs or a refresh.
+ *
+ * If a load throws, get() that waits for it rethrows the exception, and a
+ * failed refresh keeps the stale value until the hard expiry. */
+template<class Key, class Value, class Hash = DefaultHash<Key>, class Clock = std::chrono::steady_clock>
+class LoadingCache {
+ public:
+    using Loader = std::function<Value(const Key&)>;
+    using Duration = typename Clock::duration;
+
+    // Constructs cache with 'workers' threads for refreshes, at least one.
+    LoadingCache(Loader loader, Duration softTtl, Duration hardTtl, size_t workers = 2, const Hash& hasher = Hash())
+            : loader_(std::move(loader)),
+              softTtl_(softTtl),
+              hardTtl_(hardTtl),
+              entries_(hasher),
+              lastTicket_(0),
+              stopping_(false) {
+        if (softTtl > hardTtl) {
+            throw std::invalid_argument("Soft TTL of LoadingCache exceeds hard TTL");
+        }
+        if (workers == 0) {
+            // Queued refreshes would never run, and get() would wait for them after hard expiry.
+            throw std::invalid_argument("LoadingCache needs at least one worker");
+        }
+        for (size_t i = 0; i < workers; ++i) {
+            workers_.emplace_back([this] { run_worker(); });
+        }
+    }
+
+    LoadingCache(const LoadingCache&) = delete;
+    LoadingCache& operator=(const LoadingCache&) = delete;
+
+    // Stops workers, queued refreshes are dropped.
+    ~LoadingCache() {
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            stopping_ = true;
+        }
+        queueCondition_.notify_all();
+        for (std::thread& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    // Returns number of cached keys, including ones that are being loaded.
+    size_t size() const {
+        std::lock_guard<std::mutex> guard(mutex_);
+        return entries_.size();
+    }
+
+    /* Returns value of 'key'. Loads it if it is missing or hard expired,
+     * refreshes it in background if it is soft expired. */
+    Value get(const Key& key) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            Entry& entry = entries_[key];
+
+            typename Clock::time_point now = Clock::now();
+            if (entry.value && now - entry.loadedAt < hardTtl_) {
+                if (now - entry.loadedAt >= softTtl_ && entry.loadTicket == 0) {
+                    entry.loadTicket = ++lastTicket_;
+                    queue_.emplace_back(key, entry.loadTicket);
+                    queueCondition_.notify_one();
+                }
+                return *entry.value;
+            }
+
+            if (entry.loadTicket != 0) {
+                // Somebody loads the key, the entry may be replaced meanwhile, so it is found again.
+                loaded_.wait(lock);
+                continue;
+            }
+
+            uint64_t ticket = ++lastTicket_;
+            entry.loadTicket = ticket;
+            lock.unlock();
+            std::optional<Value> value;
+            std::exception_ptr error;
+            try {
+                value = loader_(key);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            lock.lock();
+            finish_load(key, ticket, value);
+
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            return *value;
+        }
+    }
+
+    /* Deletes cached value of 'key'. A load of the key in progress isn't
+     * stored then, and the next get() loads it again. */
+    void invalidate(const Key& key) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        entries_.erase(key);
+        loaded_.notify_all();
+    }
+
+    // Deletes all cached values, like invalidate() of every key.
+    void clear() {
+        std::lock_guard<std::mutex> guard(mutex_);
+        entries_.clear();
+        loaded_.notify_all();
+    }
+
+    /* Returns approximate number of bytes used by entries and refresh queue,
+     * see HashMap::memory_usage(). */
+    size_t memory_usage() const {
+        std::lock_guard<std::mutex> guard(mutex_);
+        return sizeof(*this) + entries_.memory_usage() - sizeof(entries_) +
+               queue_.size() * sizeof(std::pair<Key, uint64_t>) + workers_.capacity() * sizeof(std::thread);
+    }
+
+    void shrink_to_fit() {
+        std::lock_guard<std::mutex> guard(mutex_);
+        entries_.shrink_to_fit();
+        queue_.shrink_to_fit();
+    }
+
+    /* Deletes the least recently loaded values until memory_usage() decreases
+     * by about 'bytes', then shrinks table. Keys being loaded are kept. */
+    void evict_memory(size_t bytes) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        if (entries_.empty()) {
+            return;
+        }
+        size_t perEntry = std::max<size_t>(entries_.memory_usage() / entries_.size(), 1);
+        size_t count = (bytes + perEntry - 1) / perEntry;
+
+        std::vector<std::pair<typename Clock::time_point, Key> > loaded;
+        for (const auto& [key, entry] : entries_) {
+            if (entry.value && entry.loadTicket == 0) {
+                loaded.emplace_back(entry.loadedAt, key);
+            }
+        }
+        count = std::min(count, loaded.size());
+        std::nth_element(loaded.begin(), loaded.begin() + count, loaded.end(), [](const auto& left, const auto& right) {
+            return left.first < right.first;
+        });
+        for (size_t i = 0; i < count; ++i) {
+            entries_.erase(loaded[i].second);
+        }
+        entries_.shrink_to_fit();
+    }
+
+ private:
+    struct Entry {
+        std::optional<Value> value;
+        typename Clock::time_point loadedAt;
+        uint64_t loadTicket = 0;  // Ticket of load in progress, 0 if there is none
+    };
+
+    Loader loader_;
+    Duration softTtl_;
+    Duration hardTtl_;
+
+    mutable std::mutex mutex_;  // Guards all fields below
+    HashMap<Key, Entry, Hash> entries_;
+    uint64_t lastTicket_;
+    std::condition_variable loaded_;  // Notified when a load finishes
+
+    std::deque<std::pair<Key, uint64_t> > queue_;  // Keys to refresh and tickets of refreshes
+    std::condition_variable queueCondition_;
+    std::vector<std::thread> workers_;
+    bool stopping_;
+
+    /* Stores loaded value if the load with 'ticket' is still the current
+     * load of 'key'; keeps the old value if load failed. */
+    void finish_load(const Key& key, uint64_t ticket, const std::optional<Value>& value) {
+        auto it = entries_.find(key);
+        if (it != entries_.end() && it->second.loadTicket == ticket) {
+            Entry& entry = it->second;
+            entry.loadTicket = 0;
+            if (value) {
+                entry.value = value;
+                entry.loadedAt = Clock::now();
+            } else if (!entry.value) {
+                entries_.erase(key);
+            }
+        }
+        loaded_.notify_all();
+    }
+
+    void run_worker() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            queueCondition_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+            if (stopping_) {
+                return;
+            }
+
+            std::pair<Key, uint64_t> task = std::move(queue_.front());
+            queue_.pop_front();
+            lock.unlock();
+            std::optional<Value> value;
+            try {
+                value = loader_(task.first);
+            } catch (...) {
+                // Stale value stays until hard expiry, the next soft expired get() retries.
+            }
+            lock.lock();
+            finish_load(task.first, task.second, value);
+        }
+    }
+};
@@ -0,0 +1,251 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace memory_budget_impl {
+
+template<class Map, class Enable = void>
+struct HasShrinkToFit : std::false_type {
+};
+
+template<class Map>
+struct HasShrinkToFit<Map, decltype(void(std::declval<Map&>().shrink_to_fit()))> : std::true_type {
+};
+
+template<class Map, class Enable = void>
+struct HasClear : std::false_type {
+};
+
+template<class Map>
+struct HasClear<Map, decltype(void(std::declval<Map&>().clear()))> : std::true_type {
+};
+
+template<class Map, class Enable = void>
+struct HasEvictMemory : std::false_type {
+};
+
+template<class Map>
+struct HasEvictMemory<Map, decltype(void(std::declval<Map&>().evict_memory(size_t(0))))> : std::true_type {
+};
+
+}  // namespace memory_budget_impl
+
+/* Memory limit shared by maps and caches of a process.
+ *
+ * Every consumer registers a function that returns its usage in bytes,
+ * a priority and a function that frees memory under pressure, e.g. evicts
+ * from a cache, shrinks or clears a map. enforce() sums the usage and,
+ * if it exceeds the limit, asks consumers to free memory in order of
+ * priority (lower first; bigger first among equal ones) until it fits.
+ *
+ * Nothing calls enforce() by itself: the application calls it, e.g. from
+ * a periodic timer or after a batch of inserts, and checks usage() as
+ * often as it can afford, since usage of concurrent maps takes their locks.
+ *
+ * Callbacks run on the thread that calls enforce() under the lock of the
+ * budget: they must be safe to call from it and must not register or
+ * unregister consumers. Caches that aren't thread-safe, like WeightedCache,
+ * must be enforced from the thread that uses them. A consumer is
+ * unregistered when its Registration is destroyed, so it must not outlive
+ * the registered object. */
+class MemoryBudget {
+ public:
+    using Usage = std::function<size_t()>;
+    using Reclaim = std::function<void(size_t excess)>;  // 'excess' - bytes over the limit
+
+    // What a map registered by register_map() does under pressure.
+    enum class PressureAction {
+        kNone,  // Nothing, usage is only counted, e.g. of maps that can't free memory
+        kShrink,  // shrink_to_fit()
+        kClear,  // clear() and shrink_to_fit() if map has it
+        kEvict,  // evict_memory(excess), caches evict the least valuable elements
+    };
+
+    // Handle of registered consumer, unregisters it on destruction.
+    class Registration {
+     public:
+        Registration() : budget_(nullptr), id_(0) {
+        }
+
+        Registration(MemoryBudget* budget, uint64_t id) : budget_(budget), id_(id) {
+        }
+
+        Registration(Registration&& other) : budget_(other.budget_), id_(other.id_) {
+            other.budget_ = nullptr;
+        }
+
+        Registration& operator=(Registration&& other) {
+            if (&other != this) {
+                reset();
+                budget_ = other.budget_;
+                id_ = other.id_;
+                other.budget_ = nullptr;
+            }
+            return *this;
+        }
+
+        Registration(const Registration&) = delete;
+        Registration& operator=(const Registration&) = delete;
+
+        ~Registration() {
+            reset();
+        }
+
+        // Unregisters consumer now.
+        void reset() {
+            if (budget_ != nullptr) {
+                budget_->unregister(id_);
+                budget_ = nullptr;
+            }
+        }
+
+     private:
+        MemoryBudget* budget_;
+        uint64_t id_;
+    };
+
+    explicit MemoryBudget(size_t limit = SIZE_MAX) : limit_(limit), lastId_(0) {
+    }
+
+    MemoryBudget(const MemoryBudget&) = delete;
+    MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+    // Returns budget of the whole process, unlimited until set_limit().
+    static MemoryBudget& global() {
+        static MemoryBudget budget;
+        return budget;
+    }
+
+    size_t limit() const {
+        std::lock_guard<std::mutex> guard(mutex_);
+        return limit_;
+    }
+
+    void set_limit(size_t limit) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        limit_ = limit;
+    }
+
+    // Registers consumer; 'name' is for diagnostics only.
+    Registration register_consumer(std::string name, int priority, Usage usage, Reclaim reclaim) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        uint64_t id = ++lastId_;
+        consumers_.push_back({id, std::move(name), priority, std::move(usage), std::move(reclaim)});
+        return Registration(this, id);
+    }
+
+    /* Registers HashMap or any map or cache with memory_usage(); under
+     * pressure it does 'action'. Throws std::invalid_argument if the map
+     * hasn't the method that 'action' needs. */
+    template<class Map>
+    Registration register_map(std::string name, Map& map, int priority,
+                              PressureAction action = PressureAction::kShrink) {
+        constexpr bool kCanShrink = memory_budget_impl::HasShrinkToFit<Map>::value;
+        constexpr bool kCanClear = memory_budget_impl::HasClear<Map>::value;
+        constexpr bool kCanEvict = memory_budget_impl::HasEvictMemory<Map>::value;
+        if ((action == PressureAction::kShrink && !kCanShrink) || (action == PressureAction::kClear && !kCanClear) ||
+                (action == PressureAction::kEvict && !kCanEvict)) {
+            throw std::invalid_argument("Map " + name + " doesn't support its pressure action");
+        }
+
+        return register_consumer(std::move(name), priority,
+            [&map] {
+                return map.memory_usage();
+            },
+            [&map, action](size_t excess) {
+                if constexpr (kCanEvict) {
+                    if (action == PressureAction::kEvict) {
+                        map.evict_memory(excess);
+                    }
+                }
+                if constexpr (kCanClear) {
+                    if (action == PressureAction::kClear) {
+                        map.clear();
+                    }
+                }
+                if constexpr (kCanShrink) {
+                    if (action == PressureAction::kShrink || action == PressureAction::kClear) {
+                        map.shrink_to_fit();
+                    }
+                }
+            });
+    }
+
+    // Returns total usage of registered consumers.
+    size_t usage() const {
+        std::lock_guard<std::mutex> guard(mutex_);
+        size_t total = 0;
+        for (const Consumer& consumer : consumers_) {
+            total += consumer.usage();
+        }
+        return total;
+    }
+
+    /* If total usage exceeds the limit, asks consumers to free memory until
+     * it fits or all were asked. Returns number of freed bytes. */
+    size_t enforce() {
+        std::lock_guard<std::mutex> guard(mutex_);
+
+        std::vector<std::pair<Consumer*, size_t> > usages;
+        size_t total = 0;
+        for (Consumer& consumer : consumers_) {
+            size_t usage = consumer.usage();
+            usages.emplace_back(&consumer, usage);
+            total += usage;
+        }
+        if (total <= limit_) {
+            return 0;
+        }
+
+        std::sort(usages.begin(), usages.end(), [](const auto& left, const auto& right) {
+            if (left.first->priority != right.first->priority) {
+                return left.first->priority < right.first->priority;
+            }
+            return left.second > right.second;
+        });
+
+        size_t freed = 0;
+        for (const auto& [consumer, before] : usages) {
+            if (total <= limit_) {
+                break;
+            }
+            consumer->reclaim(total - limit_);
+            size_t after = consumer->usage();
+            if (after < before) {
+                freed += before - after;
+                total -= before - after;
+            }
+        }
+        return freed;
+    }
+
+ private:
+    struct Consumer {
+        uint64_t id;
+        std::string name;
+        int priority;
+        Usage usage;
+        Reclaim reclaim;
+    };
+
+    mutable std::mutex mutex_;  // Guards all fields below
+    size_t limit_;
+    uint64_t lastId_;
+    std::vector<Consumer> consumers_;
+
+    void unregister(uint64_t id) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        consumers_.erase(std::remove_if(consumers_.begin(), consumers_.end(), [id](const Consumer& consumer) {
+            return consumer.id == id;
+        }), consumers_.end());
+    }
+};
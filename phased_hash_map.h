@@ -0,0 +1,172 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+
+#include "concurrent_hash_map.h"
+#include "hash_map.h"
+
+/* Map for a parallel build phase followed by a read-only phase.
+ *
+ * Unsealed, it is a ConcurrentHashMap and supports concurrent reads and
+ * writes. seal() moves elements to a flat open-addressing table of
+ * key-value pairs with a bitmap of full slots, and frees the concurrent
+ * one; lookups then are plain loads with no atomics or retries. Writes to
+ * a sealed map throw std::logic_error. unseal() moves elements back.
+ *
+ * seal() and unseal() must not run concurrently with other operations,
+ * e.g. call them after joining the builder threads and before starting
+ * the readers. */
+template<class Key, class Value, class Hash = DefaultHash<Key> >
+class PhasedHashMap {
+ public:
+    explicit PhasedHashMap(size_t capacity = 64, const Hash& hasher = Hash())
+            : hasher_(hasher), map_(new ConcurrentHashMap<Key, Value, Hash>(capacity, hasher)), sealedSize_(0) {
+    }
+
+    PhasedHashMap(const PhasedHashMap&) = delete;
+    PhasedHashMap& operator=(const PhasedHashMap&) = delete;
+
+    bool sealed() const {
+        return map_ == nullptr;
+    }
+
+    size_t size() const {
+        return sealed() ? sealedSize_ : map_->size();
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    /* Returns number of bytes used by the map: the flat table if it is
+     * sealed, else see ConcurrentHashMap::memory_usage(). */
+    size_t memory_usage() const {
+        size_t usage = sizeof(*this) + entries_.size() * sizeof(Entry) + full_.size() * sizeof(uint64_t);
+        return sealed() ? usage : usage + map_->memory_usage();
+    }
+
+    // Returns value of 'key' if it is in map.
+    std::optional<Value> find(const Key& key) const {
+        if (!sealed()) {
+            return map_->find(key);
+        }
+
+        size_t mask = entries_.size() - 1;
+        for (size_t i = hasher_(key) & mask; is_full(i); i = (i + 1) & mask) {
+            if (entries_[i].key == key) {
+                return entries_[i].value;
+            }
+        }
+        return std::nullopt;
+    }
+
+    // Inserts element if 'key' isn't in map. Returns true if element was inserted.
+    bool insert(const Key& key, const Value& value) {
+        check_unsealed();
+        return map_->insert(key, value);
+    }
+
+    // Inserts element or replaces value of 'key'.
+    void insert_or_assign(const Key& key, const Value& value) {
+        check_unsealed();
+        map_->insert_or_assign(key, value);
+    }
+
+    // Deletes element with 'key'. Returns true if it was in map.
+    bool erase(const Key& key) {
+        check_unsealed();
+        return map_->erase(key);
+    }
+
+    // Calls fn(key, value) for every element.
+    template<class Fn>
+    void for_each(Fn fn) const {
+        if (!sealed()) {
+            map_->for_each(fn);
+            return;
+        }
+        for (size_t i = 0; i < entries_.size(); ++i) {
+            if (is_full(i)) {
+                fn(entries_[i].key, entries_[i].value);
+            }
+        }
+    }
+
+    // Switches map to read-only flat layout. Does nothing if it is sealed.
+    void seal() {
+        if (sealed()) {
+            return;
+        }
+
+        // Load factor is at most 3/4, with at least one free slot to stop probing.
+        size_t count = map_->size();
+        size_t capacity = 1;
+        while (capacity * 3 < count * 4 + 1) {
+            capacity *= 2;
+        }
+
+        SlotArray<Entry> entries(capacity);
+        SlotArray<uint64_t> full((capacity + 63) / 64);
+        size_t mask = capacity - 1;
+        map_->for_each([&](const Key& key, const Value& value) {
+            size_t i = hasher_(key) & mask;
+            while (full[i / 64] & (uint64_t(1) << (i % 64))) {
+                i = (i + 1) & mask;
+            }
+            entries[i].key = key;
+            entries[i].value = value;
+            full[i / 64] |= uint64_t(1) << (i % 64);
+        });
+
+        entries_.swap(entries);
+        full_.swap(full);
+        sealedSize_ = count;
+        map_.reset();
+    }
+
+    // Switches map back to concurrent mode. Does nothing if it isn't sealed.
+    void unseal() {
+        if (!sealed()) {
+            return;
+        }
+
+        std::unique_ptr<ConcurrentHashMap<Key, Value, Hash> > map(
+                new ConcurrentHashMap<Key, Value, Hash>(sealedSize_ * 4 / 3 + 1, hasher_));
+        for_each([&](const Key& key, const Value& value) {
+            map->insert(key, value);
+        });
+
+        map_ = std::move(map);
+        entries_.reset(0);
+        full_.reset(0);
+        sealedSize_ = 0;
+    }
+
+ private:
+    struct Entry {
+        Key key;
+        Value value;
+    };
+
+    Hash hasher_;
+    std::unique_ptr<ConcurrentHashMap<Key, Value, Hash> > map_;  // nullptr if sealed
+
+    // Sealed layout
+    SlotArray<Entry> entries_;
+    SlotArray<uint64_t> full_;  // Bitmap of full entries
+    size_t sealedSize_;
+
+    bool is_full(size_t i) const {
+        return full_[i / 64] & (uint64_t(1) << (i % 64));
+    }
+
+    void check_unsealed() const {
+        if (sealed()) {
+            throw std::logic_error("PhasedHashMap is sealed");
+        }
+    }
+};
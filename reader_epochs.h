@@ -0,0 +1,99 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+/* Epochs of readers that look at shared objects without locks, to know
+ * when a replaced object can be freed.
+ *
+ * A thread counts itself as a reader of the current epoch (in one of a few
+ * striped counters) while it holds a Guard. A writer that replaces an object
+ * retires the old one with the current epoch. advance() moves to the next
+ * epoch when no readers of the previous one are left, and an object retired
+ * two epochs ago is freed then, as no reader can hold it anymore. Advancing
+ * never waits, so objects of the last changes may wait for the next ones.
+ *
+ * The epoch, counters and pointers to shared objects must use sequentially
+ * consistent order: a reader takes its Guard before it loads a pointer. */
+class ReaderEpochs {
+ public:
+    // Counts a thread as a reader of the current epoch while it exists.
+    class Guard {
+     public:
+        explicit Guard(const ReaderEpochs& epochs) {
+            uint64_t epoch = epochs.epoch_.load();
+            count_ = &epochs.readers_[epoch & 1][stripe()].value;
+            count_->fetch_add(1);
+        }
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+
+        ~Guard() {
+            count_->fetch_sub(1, std::memory_order_release);
+        }
+
+     private:
+        std::atomic<size_t>* count_;
+    };
+
+    // Returns epoch to retire objects with.
+    uint64_t current() const {
+        return epoch_.load(std::memory_order_relaxed);
+    }
+
+    /* Advances epoch up to two times if readers allow, after each advance
+     * calls free(epoch): objects retired before 'epoch' can be freed.
+     * Calls must be serialized with each other and with retirements. */
+    template<class Free>
+    void advance(Free free) {
+        for (int i = 0; i < 2; ++i) {
+            uint64_t epoch = epoch_.load(std::memory_order_relaxed);
+            // Readers of the previous epoch count in the other parity, as will readers of the next one.
+            for (const ReaderCount& count : readers_[(epoch + 1) & 1]) {
+                if (count.value.load() != 0) {
+                    return;
+                }
+            }
+            epoch_.store(epoch + 1);
+
+            // Readers of epochs up to 'epoch - 1' are gone: one advance ago readers of the other parity were.
+            free(epoch);
+        }
+    }
+
+ private:
+    static constexpr size_t kStripes = 16;
+
+    // Counter of readers on its own cache line.
+    struct alignas(64) ReaderCount {
+        std::atomic<size_t> value{0};
+    };
+
+    std::atomic<uint64_t> epoch_{0};
+    mutable ReaderCount readers_[2][kStripes];  // By parity of epoch
+
+    // Spreads threads over reader counters.
+    static size_t stripe() {
+        static std::atomic<size_t> lastStripe(0);
+        static thread_local size_t stripe = lastStripe.fetch_add(1, std::memory_order_relaxed) % kStripes;
+        return stripe;
+    }
+};
+
+// Objects with epochs of their retirement.
+template<class Object>
+using RetiredList = std::vector<std::pair<uint64_t, std::unique_ptr<Object> > >;
+
+// Frees objects retired in epochs before 'epoch'.
+template<class Object>
+void free_retired(RetiredList<Object>& retired, uint64_t epoch) {
+    retired.erase(std::remove_if(retired.begin(), retired.end(), [epoch](const auto& entry) {
+        return entry.first < epoch;
+    }), retired.end());
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+#include "hash_map.h"
+
+/* Map with approximate expiry by generations, e.g. for deduplication windows.
+ *
+ * Elements are kept in 'generations' HashMaps. Writes go to the newest one,
+ * lookups check them from the newest to the oldest and move a found
+ * element to the newest. Every 'interval' (or on rotate()) the oldest
+ * generation is cleared and becomes the newest. So an element lives
+ * between (generations - 1) and 'generations' intervals after its last use,
+ * with no timestamps per element and no expiry scans.
+ *
+ * Like HashMap, the map isn't thread-safe. */
+template<class Key, class Value, class Hash = DefaultHash<Key>, class Clock = std::chrono::steady_clock>
+class RotatingHashMap {
+ public:
+    using Duration = typename Clock::duration;
+
+    /* Constructs map of 'generations' generations that rotate every 'interval'.
+     * Zero interval - they rotate only by rotate(). */
+    explicit RotatingHashMap(size_t generations, Duration interval = Duration::zero(), const Hash& hasher = Hash())
+            : generations_(generations, HashMap<Key, Value, Hash>(hasher)),
+              newest_(0),
+              interval_(interval),
+              nextRotation_(Clock::now() + interval) {
+        if (generations == 0) {
+            throw std::invalid_argument("RotatingHashMap needs at least one generation");
+        }
+    }
+
+    // Returns number of elements in all generations.
+    size_t size() const {
+        size_t size = 0;
+        for (const auto& generation : generations_) {
+            size += generation.size();
+        }
+        return size;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    /* Returns pointer to value of 'key' or nullptr. Found element moves to
+     * the newest generation. Pointer is valid until the next change of map. */
+    Value* find(const Key& key) {
+        rotate_if_due();
+        for (size_t age = 0; age < generations_.size(); ++age) {
+            HashMap<Key, Value, Hash>& generation = generation_of_age(age);
+            auto it = generation.find(key);
+            if (it == generation.end()) {
+                continue;
+            }
+            if (age == 0) {
+                return &it->second;
+            }
+
+            Value& moved = newest()[key];
+            moved = it->second;
+            generation.erase(key);
+            return &moved;
+        }
+        return nullptr;
+    }
+
+    // Checks if 'key' is in map, moves its element to the newest generation.
+    bool contains(const Key& key) {
+        return find(key) != nullptr;
+    }
+
+    // Inserts element or replaces value of 'key' in the newest generation.
+    void insert_or_assign(const Key& key, const Value& value) {
+        rotate_if_due();
+        for (size_t age = 1; age < generations_.size(); ++age) {
+            generation_of_age(age).erase(key);
+        }
+        newest()[key] = value;
+    }
+
+    // Deletes element with 'key' from all generations.
+    void erase(const Key& key) {
+        for (auto& generation : generations_) {
+            generation.erase(key);
+        }
+    }
+
+    // Drops the oldest generation and starts a new one.
+    void rotate() {
+        newest_ = (newest_ + 1) % generations_.size();
+        newest().clear();
+    }
+
+    void clear() {
+        for (auto& generation : generations_) {
+            generation.clear();
+        }
+    }
+
+    // Returns approximate number of bytes used by generations, see HashMap::memory_usage().
+    size_t memory_usage() const {
+        size_t usage = sizeof(*this);
+        for (const auto& generation : generations_) {
+            usage += generation.memory_usage();
+        }
+        return usage;
+    }
+
+    void shrink_to_fit() {
+        for (auto& generation : generations_) {
+            generation.shrink_to_fit();
+        }
+    }
+
+    /* Drops generations from the oldest one until memory_usage() decreases
+     * by about 'bytes'. The newest one is dropped the last. */
+    void evict_memory(size_t bytes) {
+        size_t freed = 0;
+        for (size_t age = generations_.size(); age > 0 && freed < bytes; --age) {
+            HashMap<Key, Value, Hash>& generation = generation_of_age(age - 1);
+            size_t before = generation.memory_usage();
+            generation.clear();
+            generation.shrink_to_fit();
+            freed += before - generation.memory_usage();
+        }
+    }
+
+ private:
+    std::vector<HashMap<Key, Value, Hash> > generations_;  // Ring of generations
+    size_t newest_;  // Index of the newest generation
+    Duration interval_;
+    typename Clock::time_point nextRotation_;
+
+    HashMap<Key, Value, Hash>& newest() {
+        return generations_[newest_];
+    }
+
+    // Returns generation that is 'age' rotations older than the newest one.
+    HashMap<Key, Value, Hash>& generation_of_age(size_t age) {
+        return generations_[(newest_ + generations_.size() - age) % generations_.size()];
+    }
+
+    // Rotates once per interval passed since the last rotation.
+    void rotate_if_due() {
+        if (interval_ == Duration::zero()) {
+            return;
+        }
+
+        typename Clock::time_point now = Clock::now();
+        if (now < nextRotation_) {
+            return;
+        }
+
+        // After a long pause all generations are dropped, more rotations change nothing.
+        auto passed = (now - nextRotation_) / interval_ + 1;
+        for (decltype(passed) i = 0; i < passed && i < static_cast<decltype(passed)>(generations_.size()); ++i) {
+            rotate();
+        }
+        nextRotation_ += passed * interval_;
+    }
+};
@@ -0,0 +1,566 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "hash_map.h"
+#include "reader_epochs.h"
+
+/* Concurrent map of HashMap shards, each under its own mutex, found by
+ * extendible hashing.
+ *
+ * The directory has 2^depth entries indexed by high bits of hash, and
+ * a shard with local depth d owns all entries with its d-bit prefix. A shard
+ * is split by the next hash bit when it has more than 'maxShardSize' elements
+ * or when it is hot: threads waited for its lock in a quarter of its last
+ * kContentionWindow uses. Two sibling shards are merged when both become
+ * small, except children of a hot split until they cool down. Only the
+ * directory entries of those shards change, there is no global resize.
+ *
+ * The directory is immutable and replaced by a new one on every split or
+ * merge, so threads find shards with no locks. A replaced shard is marked
+ * retired, and a thread that locked it retries with the new directory.
+ *
+ * Old directories and shards are freed by ReaderEpochs: every operation
+ * counts itself as a reader while it uses a directory, and splits and
+ * merges free what no reader can hold anymore.
+ *
+ * get_or_compute() memoizes a function: concurrent callers for the same
+ * missing key wait for one computation instead of repeating it. */
+template<class Key, class Value, class Hash = DefaultHash<Key> >
+class ShardedHashMap {
+ public:
+    static constexpr size_t kMaxDepth = 16;  // At most 2^kMaxDepth shards
+
+    explicit ShardedHashMap(size_t maxShardSize = 1 << 14, const Hash& hasher = Hash())
+            : hasher_(hasher), maxShardSize_(maxShardSize), size_(0) {
+        Directory* directory = new Directory(0);
+        directory->shards[0] = new_shard(0, 0);
+        directory_.store(directory);
+    }
+
+    ShardedHashMap(const ShardedHashMap&) = delete;
+    ShardedHashMap& operator=(const ShardedHashMap&) = delete;
+
+    // Destroys map, must not run concurrently with other operations.
+    ~ShardedHashMap() {
+        Directory* directory = directory_.load();
+        for (size_t i = 0; i < directory->shards.size();) {
+            Shard* shard = directory->shards[i];
+            i += size_t(1) << (directory->depth - shard->depth);  // Skips other entries of the shard
+            delete shard;
+        }
+        delete directory;
+    }
+
+    // Returns number of elements. Under concurrent writes it is approximate.
+    size_t size() const {
+        return size_.load(std::memory_order_relaxed);
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    // Returns number of shards.
+    size_t shard_count() const {
+        std::lock_guard<std::mutex> guard(structureMutex_);
+        return shardCount_;
+    }
+
+    /* Returns approximate number of bytes used by directory and shards, see
+     * HashMap::memory_usage(), including replaced ones that aren't freed yet. */
+    size_t memory_usage() const {
+        std::lock_guard<std::mutex> structureGuard(structureMutex_);
+        const Directory* directory = directory_.load();
+        size_t usage = sizeof(*this) + directory_memory(directory);
+        for (size_t i = 0; i < directory->shards.size(); ++i) {
+            Shard* shard = directory->shards[i];
+            if (i == first_entry(directory, shard)) {
+                std::lock_guard<std::mutex> guard(shard->mutex);
+                usage += shard_memory(shard);
+            }
+        }
+        // Retired ones don't change anymore.
+        for (const auto& entry : retiredShards_) {
+            usage += shard_memory(entry.second.get());
+        }
+        for (const auto& entry : retiredDirectories_) {
+            usage += directory_memory(entry.second.get());
+        }
+        return usage;
+    }
+
+    // Shrinks tables of all shards, see HashMap::shrink_to_fit(), and frees replaced shards if it can.
+    void shrink_to_fit() {
+        for_each_shard([](Shard& shard) {
+            shard.map.shrink_to_fit();
+        });
+        reclaim();
+    }
+
+    // Deletes all elements. Shards are merged back by the following writes.
+    void clear() {
+        for_each_shard([this](Shard& shard) {
+            size_.fetch_sub(shard.map.size(), std::memory_order_relaxed);
+            shard.map.clear();
+            shard.size.store(0, std::memory_order_relaxed);
+        });
+    }
+
+    // Returns value of 'key' if it is in map.
+    std::optional<Value> find(const Key& key) const {
+        return with_shard(key, [&](Shard& shard) {
+            auto it = shard.map.find(key);
+            return it != shard.map.end() ? std::optional<Value>(it->second) : std::nullopt;
+        });
+    }
+
+    // Inserts element if 'key' isn't in map. Returns true if element was inserted.
+    bool insert(const Key& key, const Value& value) {
+        return write(key, [&](Shard& shard) {
+            size_t size = shard.map.size();
+            shard.map.insert({key, value});
+            return shard.map.size() > size;
+        });
+    }
+
+    // Inserts element or replaces value of 'key'.
+    void insert_or_assign(const Key& key, const Value& value) {
+        write(key, [&](Shard& shard) {
+            size_t size = shard.map.size();
+            shard.map[key] = value;
+            return shard.map.size() > size;
+        });
+    }
+
+    // Deletes element with 'key'. Returns true if it was in map.
+    bool erase(const Key& key) {
+        bool erased = false;
+        write(key, [&](Shard& shard) {
+            size_t size = shard.map.size();
+            shard.map.erase(key);
+            erased = shard.map.size() < size;
+            return false;
+        });
+        return erased;
+    }
+
+    /* Returns value of 'key', computing it by fn() and inserting if it is
+     * missing. Only one caller computes a missing key, others wait for it
+     * and get its result or its exception. Exceptions aren't cached. */
+    template<class Fn>
+    Value get_or_compute(const Key& key, Fn fn) {
+        std::optional<Value> found = find(key);
+        if (found) {
+            return *found;
+        }
+
+        FlightStripe& stripe = flightStripes_[flight_stripe(key)];
+        std::shared_ptr<Flight> flight;
+        {
+            std::unique_lock<std::mutex> lock(stripe.mutex);
+            // Value is inserted before its flight is removed, so it is in map or in flight now.
+            found = find(key);
+            if (found) {
+                return *found;
+            }
+
+            auto it = stripe.flights.find(key);
+            if (it != stripe.flights.end()) {
+                std::shared_ptr<Flight> other = it->second;
+                other->done.wait(lock, [&] { return other->finished; });
+                if (other->error) {
+                    std::rethrow_exception(other->error);
+                }
+                return *other->value;
+            }
+
+            flight = std::make_shared<Flight>();
+            stripe.flights.insert({key, flight});
+        }
+
+        std::optional<Value> value;
+        std::exception_ptr error;
+        try {
+            value = fn();
+            if (!insert(key, *value)) {
+                // Key was inserted by insert() of another thread meanwhile.
+                value = find(key).value_or(*value);
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(stripe.mutex);
+            flight->finished = true;
+            flight->value = value;
+            flight->error = error;
+            stripe.flights.erase(key);
+        }
+        flight->done.notify_all();
+
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return *value;
+    }
+
+    /* Calls fn(key, value) for every element. Elements of a shard are copied
+     * under its lock and fn runs after unlocking, so fn may write to the map.
+     * Shards are walked by hash prefix, a shard replaced meanwhile is found
+     * again in the new directory. Elements written concurrently may be missed
+     * or visited twice. */
+    template<class Fn>
+    void for_each(Fn fn) const {
+        constexpr size_t kEnd = size_t(1) << kMaxDepth;
+        std::vector<std::pair<Key, Value> > elements;
+        ReaderEpochs::Guard reader(epochs_);
+        // Hashes with kMaxDepth-bit prefixes from 'next' on are not visited yet.
+        for (size_t next = 0; next < kEnd;) {
+            const Directory* directory = directory_.load();
+            Shard* shard = directory->shards[next >> (kMaxDepth - directory->depth)];
+            {
+                std::lock_guard<std::mutex> guard(shard->mutex);
+                if (shard->retired) {
+                    continue;
+                }
+                elements.clear();
+                for (auto it = shard->map.begin(); it != shard->map.end(); ++it) {
+                    elements.emplace_back(it->first, it->second);
+                }
+                next = (shard->prefix + 1) << (kMaxDepth - shard->depth);
+            }
+            for (const auto& element : elements) {
+                fn(element.first, element.second);
+            }
+        }
+    }
+
+ private:
+    static constexpr size_t kHashBits = sizeof(size_t) * 8;
+    static constexpr size_t kContentionWindow = 4096;  // Uses of a shard after which its contention is judged
+    static constexpr size_t kHotContention = kContentionWindow / 4;  // Waits for lock in a window of a hot shard
+    static constexpr size_t kMinHotSplitSize = 64;  // Smaller shards aren't split for contention
+
+    struct Shard {
+        std::mutex mutex;
+        HashMap<Key, Value, Hash> map;
+        size_t depth;  // Number of hash bits in prefix
+        size_t prefix;  // High 'depth' bits of hashes of all keys
+        bool retired;  // Shard was replaced, written under both 'mutex' and structureMutex_
+        std::atomic<size_t> size;  // Size of 'map', read without lock to skip merges that won't happen
+        std::atomic<bool> splitForHeat;  // Shard is a child of a hot split and isn't merged
+
+        // Contention in the current window, guarded by 'mutex'
+        size_t uses;
+        size_t waits;  // Uses that waited for 'mutex'
+        bool hot;  // The last window had at least kHotContention waits
+
+        Shard(size_t depth, size_t prefix, const Hash& hasher) :
+                map(hasher),
+                depth(depth),
+                prefix(prefix),
+                retired(false),
+                size(0),
+                splitForHeat(false),
+                uses(0),
+                waits(0),
+                hot(false) {
+        }
+    };
+
+    // Computation of get_or_compute(), fields are guarded by the mutex of its stripe.
+    struct Flight {
+        bool finished = false;
+        std::optional<Value> value;
+        std::exception_ptr error;
+        std::condition_variable done;
+    };
+
+    // Computations in progress of keys with the same hash bits.
+    struct FlightStripe {
+        std::mutex mutex;
+        HashMap<Key, std::shared_ptr<Flight>, Hash> flights;
+    };
+
+    static constexpr size_t kFlightStripes = 16;
+
+    struct Directory {
+        size_t depth;
+        std::vector<Shard*> shards;
+
+        explicit Directory(size_t depth) : depth(depth), shards(size_t(1) << depth) {
+        }
+    };
+
+    Hash hasher_;
+    size_t maxShardSize_;
+    std::atomic<size_t> size_;
+    std::atomic<Directory*> directory_;  // Uses sequentially consistent order, see ReaderEpochs
+    ReaderEpochs epochs_;
+
+    mutable std::mutex structureMutex_;  // Serializes splits and merges, guards fields below
+    size_t shardCount_ = 0;
+    RetiredList<Shard> retiredShards_;
+    RetiredList<Directory> retiredDirectories_;
+
+    FlightStripe flightStripes_[kFlightStripes];
+
+    // Returns 'depth' high bits of hash.
+    static size_t prefix_of(size_t hash, size_t depth) {
+        return depth == 0 ? 0 : hash >> (kHashBits - depth);
+    }
+
+    // Stripe takes low bits of hash, as shards take high ones.
+    size_t flight_stripe(const Key& key) const {
+        return hasher_(key) % kFlightStripes;
+    }
+
+    // Returns index of the first directory entry of shard.
+    static size_t first_entry(const Directory* directory, const Shard* shard) {
+        return shard->prefix << (directory->depth - shard->depth);
+    }
+
+    static size_t shard_memory(const Shard* shard) {
+        return sizeof(Shard) - sizeof(shard->map) + shard->map.memory_usage();
+    }
+
+    static size_t directory_memory(const Directory* directory) {
+        return sizeof(Directory) + directory->shards.capacity() * sizeof(Shard*);
+    }
+
+    // Calls fn(shard) for every shard under its lock, while shards can't be split or merged.
+    template<class Fn>
+    void for_each_shard(Fn fn) {
+        std::lock_guard<std::mutex> structureGuard(structureMutex_);
+        const Directory* directory = directory_.load();
+        for (size_t i = 0; i < directory->shards.size(); ++i) {
+            Shard* shard = directory->shards[i];
+            if (i == first_entry(directory, shard)) {
+                std::lock_guard<std::mutex> guard(shard->mutex);
+                fn(*shard);
+            }
+        }
+    }
+
+    Shard* new_shard(size_t depth, size_t prefix) {
+        ++shardCount_;
+        return new Shard(depth, prefix, hasher_);
+    }
+
+    /* Calls fn(shard) under lock of the shard of 'key', returns its result.
+     * Counts contention to find hot shards. */
+    template<class Fn>
+    auto with_shard(const Key& key, Fn fn) const {
+        size_t hash = hasher_(key);
+        ReaderEpochs::Guard reader(epochs_);
+        while (true) {
+            const Directory* directory = directory_.load();
+            Shard& shard = *directory->shards[prefix_of(hash, directory->depth)];
+
+            std::unique_lock<std::mutex> lock(shard.mutex, std::try_to_lock);
+            bool waited = !lock.owns_lock();
+            if (waited) {
+                lock.lock();
+            }
+            if (!shard.retired) {
+                count_use(shard, waited);
+                return fn(shard);
+            }
+        }
+    }
+
+    /* Counts use of locked shard. At the end of a window of uses decides if
+     * the shard is hot, and ends the cooldown of a child of a hot split if
+     * the shard has cooled down to a quarter of the hot contention. */
+    static void count_use(Shard& shard, bool waited) {
+        shard.waits += waited ? 1 : 0;
+        if (++shard.uses < kContentionWindow) {
+            return;
+        }
+        shard.hot = shard.waits >= kHotContention;
+        if (shard.waits < kHotContention / 4) {
+            shard.splitForHeat.store(false, std::memory_order_relaxed);
+        }
+        shard.uses = 0;
+        shard.waits = 0;
+    }
+
+    /* Does write fn(shard) that returns true if it added an element.
+     * Then splits or merges the shard if needed. */
+    template<class Fn>
+    bool write(const Key& key, Fn fn) {
+        bool added = false;
+        bool changed = false;
+        {
+            // Keeps 'target' from being freed until split or merge looks at it.
+            ReaderEpochs::Guard reader(epochs_);
+            Shard* target = nullptr;
+            size_t shardSize = 0;
+            bool hot = false;
+            added = with_shard(key, [&](Shard& shard) {
+                size_t before = shard.map.size();
+                bool result = fn(shard);
+                shardSize = shard.map.size();
+                if (shardSize < before) {
+                    size_.fetch_sub(before - shardSize, std::memory_order_relaxed);
+                } else {
+                    size_.fetch_add(shardSize - before, std::memory_order_relaxed);
+                }
+                shard.size.store(shardSize, std::memory_order_relaxed);
+                hot = shard.hot;
+                target = &shard;
+                return result;
+            });
+
+            if (shardSize > maxShardSize_) {
+                changed = split(target, false);
+            } else if (hot && shardSize >= kMinHotSplitSize && target->depth < kMaxDepth) {
+                changed = split(target, true);
+            } else if (shardSize < maxShardSize_ / 8 && may_merge(target, shardSize)) {
+                changed = merge(target);
+            }
+        }
+        if (changed) {
+            reclaim();
+        }
+        return added;
+    }
+
+    /* Splits shard into two by the next hash bit, if it is still in directory.
+     * 'forHeat' - it is split as hot, its children aren't merged until they cool down.
+     * Returns true if it did. */
+    bool split(Shard* shard, bool forHeat) {
+        std::lock_guard<std::mutex> structureGuard(structureMutex_);
+        if (shard->retired || shard->depth == kMaxDepth) {
+            return false;
+        }
+        std::lock_guard<std::mutex> guard(shard->mutex);
+
+        size_t depth = shard->depth + 1;
+        Shard* children[2] = {new_shard(depth, shard->prefix * 2), new_shard(depth, shard->prefix * 2 + 1)};
+        for (auto it = shard->map.begin(); it != shard->map.end(); ++it) {
+            size_t bit = prefix_of(hasher_(it->first), depth) & 1;
+            children[bit]->map.insert({it->first, it->second});
+        }
+        for (Shard* child : children) {
+            child->size.store(child->map.size(), std::memory_order_relaxed);
+            child->splitForHeat.store(forHeat, std::memory_order_relaxed);
+        }
+
+        Directory* old = directory_.load(std::memory_order_relaxed);
+        Directory* directory = new Directory(std::max(old->depth, depth));
+        for (size_t i = 0; i < directory->shards.size(); ++i) {
+            Shard* owner = old->shards[i >> (directory->depth - old->depth)];
+            if (owner == shard) {
+                owner = children[(i >> (directory->depth - depth)) & 1];
+            }
+            directory->shards[i] = owner;
+        }
+        retire(shard, old, directory);
+        return true;
+    }
+
+    /* Checks without locks if a shard with 'shardSize' elements looks
+     * mergeable with its sibling, so that writes to small shards take
+     * structureMutex_ only when a merge is likely. merge() checks again. */
+    bool may_merge(const Shard* shard, size_t shardSize) const {
+        const Directory* directory = directory_.load();
+        // A shard deeper than directory was merged meanwhile.
+        if (shard->depth == 0 || shard->depth > directory->depth ||
+                shard->splitForHeat.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        // Reader guard of the caller keeps the sibling from being freed.
+        const Shard* sibling = directory->shards[(shard->prefix ^ 1) << (directory->depth - shard->depth)];
+        return sibling->depth == shard->depth && !sibling->splitForHeat.load(std::memory_order_relaxed) &&
+               shardSize + sibling->size.load(std::memory_order_relaxed) < maxShardSize_ / 4;
+    }
+
+    /* Merges shard with its sibling if both are small, cool and still in directory.
+     * Returns true if it did. */
+    bool merge(Shard* shard) {
+        std::lock_guard<std::mutex> structureGuard(structureMutex_);
+        Directory* old = directory_.load(std::memory_order_relaxed);
+        if (shard->retired || shard->depth == 0) {
+            return false;
+        }
+        Shard* sibling = old->shards[(shard->prefix ^ 1) << (old->depth - shard->depth)];
+        if (sibling->depth != shard->depth) {
+            return false;
+        }
+
+        std::scoped_lock guard(shard->mutex, sibling->mutex);
+        if (shard->map.size() + sibling->map.size() >= maxShardSize_ / 4 ||
+                shard->splitForHeat.load(std::memory_order_relaxed) ||
+                sibling->splitForHeat.load(std::memory_order_relaxed)) {
+            return false;
+        }
+
+        Shard* merged = new_shard(shard->depth - 1, shard->prefix / 2);
+        for (const Shard* part : {shard, sibling}) {
+            for (auto it = part->map.begin(); it != part->map.end(); ++it) {
+                merged->map.insert({it->first, it->second});
+            }
+        }
+        merged->size.store(merged->map.size(), std::memory_order_relaxed);
+
+        // Directory is halved while no shard needs all its bits.
+        size_t depth = old->depth;
+        while (depth > 0) {
+            bool needed = false;
+            for (Shard* owner : old->shards) {
+                needed |= owner != shard && owner != sibling && owner->depth == depth;
+            }
+            if (needed || merged->depth == depth) {
+                break;
+            }
+            --depth;
+        }
+
+        Directory* directory = new Directory(depth);
+        for (size_t i = 0; i < directory->shards.size(); ++i) {
+            Shard* owner = old->shards[i << (old->depth - depth)];
+            directory->shards[i] = owner == shard || owner == sibling ? merged : owner;
+        }
+        retire(sibling, nullptr, nullptr);
+        retire(shard, old, directory);
+        return true;
+    }
+
+    /* Marks locked shard retired and frees its elements. Replaces 'old'
+     * directory by 'directory' if it isn't nullptr, before threads waiting
+     * for the shard see it retired. Shard and old directory are freed by
+     * reclaim() when no reader can hold them. */
+    void retire(Shard* shard, Directory* old, Directory* directory) {
+        uint64_t epoch = epochs_.current();
+        if (directory != nullptr) {
+            directory_.store(directory);
+            retiredDirectories_.emplace_back(epoch, old);
+        }
+        shard->retired = true;
+        shard->map = HashMap<Key, Value, Hash>(hasher_);
+        retiredShards_.emplace_back(epoch, shard);
+        --shardCount_;
+    }
+
+    // Frees shards and directories that no reader can hold anymore. Shards must not be locked by this thread.
+    void reclaim() {
+        std::lock_guard<std::mutex> structureGuard(structureMutex_);
+        epochs_.advance([this](uint64_t epoch) {
+            free_retired(retiredShards_, epoch);
+            free_retired(retiredDirectories_, epoch);
+        });
+    }
+};
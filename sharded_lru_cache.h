@@ -0,0 +1,220 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+
+#include "hash_map.h"
+
+/* Concurrent LRU cache of 'Shards' shards, each a HashMap kept in order
+ * of use under its own lock.
+ *
+ * Lookups take the lock of their shard only shared and don't touch the
+ * order of use. Instead a hit is written to a buffer of the thread, one
+ * per shard; a full buffer is applied to the shard at once if its lock is
+ * free, else it is dropped. So the order of use is approximate but
+ * reads never wait for each other (like read buffers of Caffeine).
+ * Inserts take the lock exclusively, apply the buffer of their thread
+ * and evict least recently used elements of the shard.
+ *
+ * Taking the shared lock is still an atomic write to the lock word, so
+ * readers of one hot shard share its cache line. Values of any type can't
+ * be read without a lock here, as an insert may free them meanwhile; for
+ * trivially copyable keys and values ConcurrentHashMap reads with no
+ * writes at all. More shards spread hot keys over more lock words. */
+template<class Key, class Value, class Hash = DefaultHash<Key>, size_t Shards = 16>
+class ShardedLruCache {
+    static_assert((Shards & (Shards - 1)) == 0 && Shards <= (1 << 16), "Shards must be a power of two up to 2^16");
+
+ public:
+    static constexpr size_t kBufferSize = 16;  // Hits of a thread in a shard applied at once
+
+    // Constructs cache of at most about 'capacity' elements, split evenly among shards.
+    explicit ShardedLruCache(size_t capacity, const Hash& hasher = Hash())
+            : hasher_(hasher), shardCapacity_((capacity + Shards - 1) / Shards), id_(next_id()) {
+        if (capacity == 0) {
+            throw std::invalid_argument("ShardedLruCache capacity must be positive");
+        }
+        for (Shard& shard : shards_) {
+            shard.map = HashMap<Key, Value, Hash>(hasher);
+        }
+    }
+
+    ShardedLruCache(const ShardedLruCache&) = delete;
+    ShardedLruCache& operator=(const ShardedLruCache&) = delete;
+
+    // Returns number of elements. Under concurrent writes it is approximate.
+    size_t size() const {
+        size_t size = 0;
+        for (const Shard& shard : shards_) {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            size += shard.map.size();
+        }
+        return size;
+    }
+
+    // Returns value of 'key' if it is cached and records the use of it.
+    std::optional<Value> find(const Key& key) {
+        size_t index = shard_of(hasher_(key));
+        const Shard& shard = shards_[index];
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        auto it = shard.map.find(key);
+        if (it == shard.map.end()) {
+            return std::nullopt;
+        }
+        std::optional<Value> value = it->second;
+        lock.unlock();
+
+        record_hit(index, key);
+        return value;
+    }
+
+    // Inserts element or replaces value of 'key', evicts the least recently used ones.
+    void insert(const Key& key, const Value& value) {
+        size_t index = shard_of(hasher_(key));
+        Shard& shard = shards_[index];
+        std::lock_guard<std::shared_mutex> guard(shard.mutex);
+        drain(index, shard);
+
+        auto it = shard.map.find(key);
+        if (it != shard.map.end()) {
+            it->second = value;
+            shard.map.move_to_end(it);
+            return;
+        }
+
+        shard.map.insert({key, value});
+        while (shard.map.size() > shardCapacity_) {
+            Key victim = shard.map.begin()->first;
+            shard.map.erase(victim);
+        }
+    }
+
+    // Deletes element with 'key'. Returns true if it was cached.
+    bool erase(const Key& key) {
+        Shard& shard = shards_[shard_of(hasher_(key))];
+        std::lock_guard<std::shared_mutex> guard(shard.mutex);
+        size_t size = shard.map.size();
+        shard.map.erase(key);
+        return shard.map.size() < size;
+    }
+
+    void clear() {
+        for (Shard& shard : shards_) {
+            std::lock_guard<std::shared_mutex> guard(shard.mutex);
+            shard.map.clear();
+        }
+    }
+
+    /* Returns approximate number of bytes used by shards, see
+     * HashMap::memory_usage(). Hit buffers of threads aren't counted. */
+    size_t memory_usage() const {
+        size_t usage = sizeof(*this);
+        for (const Shard& shard : shards_) {
+            std::shared_lock<std::shared_mutex> lock(shard.mutex);
+            usage += shard.map.memory_usage() - sizeof(shard.map);
+        }
+        return usage;
+    }
+
+    void shrink_to_fit() {
+        for (Shard& shard : shards_) {
+            std::lock_guard<std::shared_mutex> guard(shard.mutex);
+            shard.map.shrink_to_fit();
+        }
+    }
+
+    /* Evicts the least recently used elements of every shard, evenly, until
+     * memory_usage() decreases by about 'bytes', then shrinks shards. */
+    void evict_memory(size_t bytes) {
+        size_t shardBytes = (bytes + Shards - 1) / Shards;
+        for (Shard& shard : shards_) {
+            std::lock_guard<std::shared_mutex> guard(shard.mutex);
+            if (shard.map.empty()) {
+                continue;
+            }
+            size_t perElement = std::max<size_t>(shard.map.memory_usage() / shard.map.size(), 1);
+            for (size_t count = (shardBytes + perElement - 1) / perElement; count > 0 && !shard.map.empty(); --count) {
+                Key victim = shard.map.begin()->first;
+                shard.map.erase(victim);
+            }
+            shard.map.shrink_to_fit();
+        }
+    }
+
+ private:
+    struct alignas(64) Shard {
+        mutable std::shared_mutex mutex;
+        HashMap<Key, Value, Hash> map;  // In order of use
+    };
+
+    // Hits of one thread in one shard that aren't applied yet.
+    struct HitBuffer {
+        uint64_t owner = 0;  // Id of cache, buffers of destroyed caches never match
+        size_t count = 0;
+        Key keys[kBufferSize];
+    };
+
+    Hash hasher_;
+    size_t shardCapacity_;
+    uint64_t id_;
+    Shard shards_[Shards];
+
+    static thread_local HitBuffer buffers_[Shards];
+
+    static uint64_t next_id() {
+        static std::atomic<uint64_t> lastId(0);
+        return lastId.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    // Shard takes high bits of hash, HashMap takes low ones.
+    static size_t shard_of(size_t hash) {
+        return (hash >> (sizeof(size_t) * 8 - 16)) & (Shards - 1);
+    }
+
+    // Writes hit to buffer of this thread, applies a full buffer if shard isn't busy.
+    void record_hit(size_t index, const Key& key) {
+        HitBuffer& buffer = buffers_[index];
+        if (buffer.owner != id_) {
+            buffer.owner = id_;
+            buffer.count = 0;
+        }
+        buffer.keys[buffer.count++] = key;
+        if (buffer.count < kBufferSize) {
+            return;
+        }
+
+        Shard& shard = shards_[index];
+        std::unique_lock<std::shared_mutex> lock(shard.mutex, std::try_to_lock);
+        if (lock.owns_lock()) {
+            drain(index, shard);
+        } else {
+            // Order of use is approximate anyway, losing hits is cheaper than waiting.
+            buffer.count = 0;
+        }
+    }
+
+    // Moves buffered keys to the end of shard order. Shard must be locked exclusively.
+    void drain(size_t index, Shard& shard) {
+        HitBuffer& buffer = buffers_[index];
+        if (buffer.owner != id_) {
+            return;
+        }
+        for (size_t i = 0; i < buffer.count; ++i) {
+            auto it = shard.map.find(buffer.keys[i]);
+            if (it != shard.map.end()) {
+                shard.map.move_to_end(it);
+            }
+        }
+        buffer.count = 0;
+    }
+};
+
+template<class Key, class Value, class Hash, size_t Shards>
+thread_local typename ShardedLruCache<Key, Value, Hash, Shards>::HitBuffer
+        ShardedLruCache<Key, Value, Hash, Shards>::buffers_[Shards];
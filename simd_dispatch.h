@@ -0,0 +1,211 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "bit_mix.h"
+#include "cpu_features.h"
+
+/* Runtime dispatch of SIMD kernels used by hash maps.
+ * Every kernel is compiled for SSE2, AVX2 and AVX-512 by target attributes,
+ * and the best level supported by CPU is chosen once, on first use. Below
+ * AVX2 hashing stays scalar, see simd_kernels_of().
+ * Environment variable HASH_MAP_SIMD_LEVEL (scalar, sse2, avx2, avx512)
+ * or force_simd_level() lower the level, e.g. for benchmarking; unknown
+ * values of the variable are reported to stderr and ignored.
+ * All levels give the same results, so the level may be changed at any time. */
+
+enum class SimdLevel {
+    kScalar,
+    kSse2,
+    kAvx2,
+    kAvx512,
+};
+
+// Table of kernels for one SIMD level.
+struct SimdKernels {
+    // Writes mix_bits() of 'count' 64 bit words from 'words' to 'hashes'.
+    void (*mix_bits_batch)(const void* words, size_t count, uint64_t* hashes);
+
+    /* Returns index of the first null pointer among slots [from, to) of
+     * pointer array 'slots', or 'to' if there is none. */
+    size_t (*find_null_slot)(const void* slots, size_t from, size_t to);
+};
+
+inline size_t find_null_slot_scalar(const void* slots, size_t from, size_t to) {
+    const unsigned char* data = static_cast<const unsigned char*>(slots);
+    for (size_t i = from; i < to; ++i) {
+        uintptr_t slot;
+        std::memcpy(&slot, data + i * sizeof(slot), sizeof(slot));
+        if (slot == 0) {
+            return i;
+        }
+    }
+    return to;
+}
+
+#ifdef HASH_MAP_X86_64
+
+// Checks 2 slots per instruction.
+inline size_t find_null_slot_sse2(const void* slots, size_t from, size_t to) {
+    const unsigned char* data = static_cast<const unsigned char*>(slots);
+    const __m128i zero = _mm_setzero_si128();
+
+    size_t i = from;
+    for (; i + 2 <= to; i += 2) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i * 8));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, zero));
+        if ((mask & 0xff) == 0xff) {
+            return i;
+        }
+        if ((mask & 0xff00) == 0xff00) {
+            return i + 1;
+        }
+    }
+    return find_null_slot_scalar(slots, i, to);
+}
+
+// Checks 4 slots per instruction.
+__attribute__((target("avx2")))
+inline size_t find_null_slot_avx2(const void* slots, size_t from, size_t to) {
+    const unsigned char* data = static_cast<const unsigned char*>(slots);
+    const __m256i zero = _mm256_setzero_si256();
+
+    size_t i = from;
+    for (; i + 4 <= to; i += 4) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i * 8));
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(block, zero)));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return find_null_slot_scalar(slots, i, to);
+}
+
+// Checks 8 slots per instruction.
+__attribute__((target("avx512f")))
+inline size_t find_null_slot_avx512(const void* slots, size_t from, size_t to) {
+    const unsigned char* data = static_cast<const unsigned char*>(slots);
+    const __m512i zero = _mm512_setzero_si512();
+
+    size_t i = from;
+    for (; i + 8 <= to; i += 8) {
+        __m512i block = _mm512_loadu_si512(data + i * 8);
+        unsigned mask = _mm512_cmpeq_epi64_mask(block, zero);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return find_null_slot_scalar(slots, i, to);
+}
+
+#endif
+
+// Returns the best level supported by CPU.
+inline SimdLevel detected_simd_level() {
+#ifdef HASH_MAP_X86_64
+    static_assert(sizeof(void*) == 8, "x86-64 kernels expect 64 bit pointers");
+    const CpuFeatures& features = cpu_features();
+    if (features.avx512) {
+        return SimdLevel::kAvx512;
+    }
+    if (features.avx2) {
+        return SimdLevel::kAvx2;
+    }
+    return SimdLevel::kSse2;
+#else
+    return SimdLevel::kScalar;
+#endif
+}
+
+// Returns kernels of 'level' or of the best supported level below it.
+inline const SimdKernels* simd_kernels_of(SimdLevel level) {
+    static const SimdKernels kScalarKernels = {&mix_bits_batch_scalar, &find_null_slot_scalar};
+#ifdef HASH_MAP_X86_64
+    // Mixing 2 words per instruction is slower than scalar code without 64 bit multiplication.
+    static const SimdKernels kSse2Kernels = {&mix_bits_batch_scalar, &find_null_slot_sse2};
+    static const SimdKernels kAvx2Kernels = {&mix_bits_batch_avx2, &find_null_slot_avx2};
+    static const SimdKernels kAvx512Kernels = {&mix_bits_batch_avx512, &find_null_slot_avx512};
+#endif
+
+    if (level > detected_simd_level()) {
+        level = detected_simd_level();
+    }
+
+    switch (level) {
+#ifdef HASH_MAP_X86_64
+        case SimdLevel::kAvx512:
+            return &kAvx512Kernels;
+        case SimdLevel::kAvx2:
+            return &kAvx2Kernels;
+        case SimdLevel::kSse2:
+            return &kSse2Kernels;
+#endif
+        default:
+            return &kScalarKernels;
+    }
+}
+
+// Reads level from HASH_MAP_SIMD_LEVEL, detected level if it isn't set.
+inline SimdLevel startup_simd_level() {
+    const char* value = std::getenv("HASH_MAP_SIMD_LEVEL");
+    if (value == nullptr) {
+        return detected_simd_level();
+    }
+
+    std::string name(value);
+    if (name == "scalar") {
+        return SimdLevel::kScalar;
+    }
+    if (name == "sse2") {
+        return SimdLevel::kSse2;
+    }
+    if (name == "avx2") {
+        return SimdLevel::kAvx2;
+    }
+    if (name == "avx512") {
+        return SimdLevel::kAvx512;
+    }
+    std::fprintf(stderr, "Unknown HASH_MAP_SIMD_LEVEL '%s', using detected level\n", value);
+    return detected_simd_level();
+}
+
+// Holds kernels currently in use.
+inline std::atomic<const SimdKernels*>& current_simd_kernels() {
+    static std::atomic<const SimdKernels*> kernels(simd_kernels_of(startup_simd_level()));
+    return kernels;
+}
+
+// Returns kernels for the current level.
+inline const SimdKernels& simd_kernels() {
+    return *current_simd_kernels().load(std::memory_order_relaxed);
+}
+
+/* Forces kernels of 'level' (or of the best supported level below it).
+ * Meant for benchmarking and testing of fallbacks. */
+inline void force_simd_level(SimdLevel level) {
+    current_simd_kernels().store(simd_kernels_of(level), std::memory_order_relaxed);
+}
+
+/* Writes mix_bits() of 'count' 64 bit words from 'words' to 'hashes'.
+ * Results are the same as of mix_bits() on every CPU. */
+inline void mix_bits_batch(const void* words, size_t count, uint64_t* hashes) {
+    simd_kernels().mix_bits_batch(words, count, hashes);
+}
+
+/* Returns index of the first null pointer in 'slots' at or after 'from',
+ * going around the end of array. Array must contain a null pointer. */
+template<class T>
+size_t find_null_slot(T* const* slots, size_t from, size_t size) {
+    const SimdKernels& kernels = simd_kernels();
+    size_t pos = kernels.find_null_slot(slots, from, size);
+    if (pos == size) {
+        pos = kernels.find_null_slot(slots, 0, from);
+    }
+    return pos;
+}
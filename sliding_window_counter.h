@@ -0,0 +1,192 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "hash_map.h"
+
+/* Counts of events per key over a sliding time window, e.g. for rate limits.
+ *
+ * Time is split into sub-windows of 'subWindow' ticks (in any units the
+ * caller uses for timestamps). Every key has a ring of the last 'SubWindows'
+ * sub-window counters stored inline in HashMap, so adding to a key allocates
+ * nothing after its first event. count() sums the sub-windows that cover
+ * the asked window, so the window is rounded up to whole sub-windows.
+ *
+ * Keys with no events in the last 'SubWindows' sub-windows are deleted by
+ * compact(), which runs by itself when the number of keys doubles.
+ *
+ * Like HashMap, the map isn't thread-safe. */
+template<class Key, class Hash = DefaultHash<Key>, size_t SubWindows = 8>
+class SlidingWindowCounter {
+    static_assert(SubWindows > 0, "SlidingWindowCounter needs at least one sub-window");
+
+ public:
+    explicit SlidingWindowCounter(uint64_t subWindow, const Hash& hasher = Hash())
+            : subWindow_(subWindow), counters_(hasher), latest_(0), compactedSize_(0) {
+        if (subWindow == 0) {
+            throw std::invalid_argument("Sub-window of SlidingWindowCounter must be positive");
+        }
+    }
+
+    // Returns number of keys with counters.
+    size_t size() const {
+        return counters_.size();
+    }
+
+    // Returns the longest window that count() can cover.
+    uint64_t max_window() const {
+        return subWindow_ * SubWindows;
+    }
+
+    /* Adds 'n' events of 'key' at time 'timestamp'. Events older than
+     * max_window() before the latest event of the key are ignored. */
+    void add(const Key& key, uint64_t n, uint64_t timestamp) {
+        add_to(counters_[key], n, timestamp);
+        maybe_compact();
+    }
+
+    /* Adds counts[i] events of keys[i] at time 'timestamp' for all i < count.
+     * Keys are looked up together, which hides memory latency. */
+    void add_batch(const Key* keys, const uint64_t* counts, size_t count, uint64_t timestamp) {
+        constexpr size_t kBatch = 16;
+        typename HashMap<Key, Counter, Hash>::iterator found[kBatch];
+        for (size_t done = 0; done < count; done += kBatch) {
+            size_t batch = std::min(kBatch, count - done);
+            counters_.find_batch(keys + done, batch, found);
+            for (size_t i = 0; i < batch; ++i) {
+                if (found[i] != counters_.end()) {
+                    add_to(found[i]->second, counts[done + i], timestamp);
+                } else {
+                    add_to(counters_[keys[done + i]], counts[done + i], timestamp);
+                }
+            }
+        }
+        maybe_compact();
+    }
+
+    /* Returns number of events of 'key' in 'window' ticks up to 'now',
+     * rounded up to whole sub-windows and limited by max_window(). */
+    uint64_t count(const Key& key, uint64_t window, uint64_t now) const {
+        auto it = counters_.find(key);
+        if (it == counters_.end()) {
+            return 0;
+        }
+
+        const Counter& counter = it->second;
+        uint64_t current = now / subWindow_;
+        uint64_t windows = std::min<uint64_t>((window + subWindow_ - 1) / subWindow_, SubWindows);
+        uint64_t total = 0;
+        for (uint64_t i = 0; i < windows && i <= current; ++i) {
+            uint64_t w = current - i;
+            if (w <= counter.newest && w + SubWindows > counter.newest) {
+                total += counter.buckets[w % SubWindows];
+            }
+        }
+        return total;
+    }
+
+    // Returns number of events of 'key' in 'window' ticks up to the latest added event.
+    uint64_t count(const Key& key, uint64_t window) const {
+        return count(key, window, latest_);
+    }
+
+    // Deletes keys with no events in max_window() before 'now'.
+    void compact(uint64_t now) {
+        uint64_t current = now / subWindow_;
+        std::vector<Key> expired;
+        for (auto it = counters_.begin(); it != counters_.end(); ++it) {
+            if (it->second.newest + SubWindows <= current) {
+                expired.push_back(it->first);
+            }
+        }
+        for (const Key& key : expired) {
+            counters_.erase(key);
+        }
+        compactedSize_ = counters_.size();
+    }
+
+    void clear() {
+        counters_.clear();
+        compactedSize_ = 0;
+    }
+
+    // Returns approximate number of bytes used by counters, see HashMap::memory_usage().
+    size_t memory_usage() const {
+        return sizeof(*this) + counters_.memory_usage() - sizeof(counters_);
+    }
+
+    void shrink_to_fit() {
+        counters_.shrink_to_fit();
+    }
+
+    /* Frees about 'bytes' of memory_usage(): compacts by the latest event,
+     * then deletes keys whose newest events are the oldest, then shrinks
+     * table. Deleted keys count from zero again, so a rate limit lets
+     * them through more. */
+    void evict_memory(size_t bytes) {
+        size_t before = memory_usage();
+        compact(latest_);
+        shrink_to_fit();
+        size_t freed = before - memory_usage();
+        if (freed >= bytes || counters_.empty()) {
+            return;
+        }
+
+        size_t perKey = std::max<size_t>(memory_usage() / counters_.size(), 1);
+        size_t count = std::min((bytes - freed + perKey - 1) / perKey, counters_.size());
+        std::vector<std::pair<uint64_t, Key> > keys;
+        keys.reserve(counters_.size());
+        for (auto it = counters_.begin(); it != counters_.end(); ++it) {
+            keys.emplace_back(it->second.newest, it->first);
+        }
+        std::nth_element(keys.begin(), keys.begin() + count, keys.end(), [](const auto& left, const auto& right) {
+            return left.first < right.first;
+        });
+        for (size_t i = 0; i < count; ++i) {
+            counters_.erase(keys[i].second);
+        }
+        compactedSize_ = counters_.size();
+        shrink_to_fit();
+    }
+
+ private:
+    static constexpr size_t kMinCompactSize = 1024;  // Smaller maps aren't compacted by themselves
+
+    // Ring of counters of the last SubWindows sub-windows of a key.
+    struct Counter {
+        uint64_t newest = 0;  // Number of the newest sub-window with events
+        uint64_t buckets[SubWindows] = {};  // Counter of sub-window w is buckets[w % SubWindows]
+    };
+
+    uint64_t subWindow_;
+    HashMap<Key, Counter, Hash> counters_;
+    uint64_t latest_;  // The latest timestamp of events
+    size_t compactedSize_;  // Number of keys after the last compaction
+
+    void add_to(Counter& counter, uint64_t n, uint64_t timestamp) {
+        latest_ = std::max(latest_, timestamp);
+        uint64_t w = timestamp / subWindow_;
+        if (w > counter.newest) {
+            // Sub-windows between the newest one and 'w' had no events.
+            uint64_t stale = std::min<uint64_t>(w - counter.newest, SubWindows);
+            for (uint64_t i = 0; i < stale; ++i) {
+                counter.buckets[(w - i) % SubWindows] = 0;
+            }
+            counter.newest = w;
+        } else if (w + SubWindows <= counter.newest) {
+            return;
+        }
+        counter.buckets[w % SubWindows] += n;
+    }
+
+    void maybe_compact() {
+        if (counters_.size() >= std::max(kMinCompactSize, 2 * compactedSize_)) {
+            compact(latest_);
+        }
+    }
+};
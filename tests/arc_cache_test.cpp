@@ -0,0 +1,58 @@
+/* Test of ArcCache on scans, builds like the stress tests:
+ *
+ *     g++ -std=c++17 -O2 -I.. arc_cache_test.cpp && ./a.out */
+
+#include <cstdint>
+#include <cstdio>
+
+#include "arc_cache.h"
+
+namespace {
+
+constexpr size_t kCapacity = 100;
+constexpr int64_t kHotKeys = 50;
+constexpr int64_t kScanKeys = 300;  // Three times the capacity, it flushes an LRU cache
+constexpr int kCycles = 20;
+constexpr int kWarmupCycles = 2;
+
+// Looks up 'key' loading it on a miss. Returns true on a hit.
+bool use(ArcCache<int64_t, int64_t>& cache, int64_t key) {
+    const int64_t* value = cache.find(key);
+    if (value == nullptr) {
+        cache.insert(key, key);
+        return false;
+    }
+    return *value == key;
+}
+
+}  // namespace
+
+int main() {
+    ArcCache<int64_t, int64_t> cache(kCapacity);
+    int64_t scanKey = kHotKeys;
+    int hotMisses = 0;
+    for (int cycle = 0; cycle < kCycles; ++cycle) {
+        // Hot keys are used twice per cycle, then a scan of keys never seen again.
+        for (int pass = 0; pass < 2; ++pass) {
+            for (int64_t key = 0; key < kHotKeys; ++key) {
+                if (!use(cache, key) && cycle >= kWarmupCycles) {
+                    ++hotMisses;
+                }
+            }
+        }
+        for (int64_t i = 0; i < kScanKeys; ++i) {
+            use(cache, scanKey++);
+        }
+        if (cache.size() > kCapacity) {
+            std::fprintf(stderr, "Cache has %zu elements, capacity is %zu\n", cache.size(), kCapacity);
+            return 1;
+        }
+    }
+
+    if (hotMisses != 0) {
+        std::fprintf(stderr, "Hot keys missed %d times after warm-up\n", hotMisses);
+        return 1;
+    }
+    std::printf("ArcCache scan test passed\n");
+    return 0;
+}
@@ -0,0 +1,70 @@
+// Stress test of CachedConcurrentHashMap for stale cache hits, see stress.h.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "cached_concurrent_hash_map.h"
+#include "stress.h"
+
+namespace {
+
+// Cache is smaller than the keys, so readers both hit and miss it all the time.
+using Map = CachedConcurrentHashMap<int64_t, int64_t, DefaultHash<int64_t>, 16>;
+
+constexpr int64_t kKeys = 64;
+constexpr size_t kOperations = 1000000;
+
+/* Writes growing versions of owned keys and reads them back: a thread
+ * must see its own writes. */
+void run_writer(Map& map, size_t thread, size_t writers) {
+    StressRandom random(thread);
+    std::vector<int64_t> versions(kKeys, 0);
+    for (size_t i = 0; i < kOperations; ++i) {
+        int64_t key = int64_t(random.next(kKeys / writers)) * int64_t(writers) + int64_t(thread);
+        if (random.next(2) == 0) {
+            map.insert_or_assign(key, ++versions[key]);
+        }
+        STRESS_CHECK(map.find(key).value_or(0) == versions[key]);
+    }
+}
+
+/* Reads keys of all writers. Versions only grow, so a find must not return
+ * an older version than any find before it returned, in any thread. */
+void run_reader(const Map& map, size_t thread, std::atomic<int64_t>* seen) {
+    StressRandom random(thread);
+    for (size_t i = 0; i < kOperations; ++i) {
+        int64_t key = int64_t(random.next(kKeys));
+        int64_t before = seen[key].load();
+        int64_t version = map.find(key).value_or(0);
+        STRESS_CHECK(version >= before);
+        while (before < version && !seen[key].compare_exchange_weak(before, version)) {
+        }
+    }
+}
+
+}  // namespace
+
+int main() {
+    size_t threads = stress_threads();
+    size_t writers = std::min<size_t>(threads / 2, kKeys);
+    Map map;
+    std::vector<std::atomic<int64_t> > seen(kKeys);
+
+    run_threads(threads, [&](size_t thread) {
+        if (thread < writers) {
+            run_writer(map, thread, writers);
+        } else {
+            run_reader(map, thread, seen.data());
+        }
+    });
+
+    for (int64_t key = 0; key < kKeys; ++key) {
+        STRESS_CHECK(map.find(key).value_or(0) >= seen[key].load());
+    }
+
+    std::printf("CachedConcurrentHashMap stress test passed\n");
+    return 0;
+}
@@ -0,0 +1,172 @@
+// Stress test of ConcurrentHashMap against reference maps, see stress.h.
+
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "concurrent_hash_map.h"
+#include "stress.h"
+
+namespace {
+
+// Two words, so a torn read shows as a value of another key.
+struct Value {
+    int64_t key;
+    int64_t version;
+
+    friend bool operator==(const Value& left, const Value& right) {
+        return left.key == right.key && left.version == right.version;
+    }
+};
+
+using Map = ConcurrentHashMap<int64_t, Value>;
+
+constexpr int64_t kHotKeys = 64;  // Keys [0, kHotKeys) are updated by all threads
+constexpr int64_t kOwnedKeys = 1 << 12;  // Owned keys per thread, erases make rebuilds of the same size too
+constexpr size_t kOperations = 300000;
+
+/* Writes owned keys checking every result, reads keys of all threads
+ * checking their values. Returns number of updates of hot keys. */
+int64_t run_writer(Map& map, size_t thread, size_t threads, std::unordered_map<int64_t, int64_t>& reference) {
+    StressRandom random(thread);
+    int64_t hotUpdates = 0;
+    int64_t version = 0;
+    for (size_t i = 0; i < kOperations; ++i) {
+        int64_t key = kHotKeys + int64_t(random.next(kOwnedKeys)) * int64_t(threads) + int64_t(thread);
+        auto it = reference.find(key);
+        switch (random.next(7)) {
+            case 0: {
+                STRESS_CHECK(map.insert(key, Value{key, ++version}) == (it == reference.end()));
+                reference.emplace(key, version);
+                break;
+            }
+            case 1: {
+                map.insert_or_assign(key, Value{key, ++version});
+                reference[key] = version;
+                break;
+            }
+            case 2: {
+                STRESS_CHECK(map.erase(key) == (it != reference.end()));
+                reference.erase(key);
+                break;
+            }
+            case 3: {
+                Value guess{key, it == reference.end() || random.next(2) == 0 ? -1 : it->second};
+                Value expected = guess;
+                bool exchanged = map.compare_exchange(key, expected, Value{key, ++version});
+                STRESS_CHECK(exchanged == (it != reference.end() && it->second == guess.version));
+                STRESS_CHECK(expected == (it == reference.end() ? guess : Value{key, it->second}));
+                if (exchanged) {
+                    it->second = version;
+                }
+                break;
+            }
+            case 4: {
+                // Deletes or bumps the element.
+                bool erase = random.next(2) == 0;
+                std::optional<Value> result = map.compute_if_present(key, [&](const Value& value) {
+                    STRESS_CHECK(value.key == key);
+                    return erase ? std::nullopt : std::optional<Value>(Value{key, value.version + 1});
+                });
+                if (it == reference.end() || erase) {
+                    STRESS_CHECK(!result);
+                    reference.erase(key);
+                } else {
+                    STRESS_CHECK(result && *result == (Value{key, ++it->second}));
+                }
+                break;
+            }
+            case 5: {
+                std::optional<Value> found = map.find(key);
+                STRESS_CHECK(found.has_value() == (it != reference.end()));
+                STRESS_CHECK(!found || *found == (Value{key, it->second}));
+                break;
+            }
+            default: {
+                int64_t hot = int64_t(random.next(kHotKeys));
+                map.update(hot, [hot](Value& value) {
+                    value.key = hot;
+                    ++value.version;
+                });
+                ++hotUpdates;
+                int64_t other = kHotKeys + int64_t(random.next(kOwnedKeys * threads));
+                std::optional<Value> found = map.find(other);
+                STRESS_CHECK(!found || found->key == other);
+                break;
+            }
+        }
+    }
+    return hotUpdates;
+}
+
+// Inserts and erases with a steady number of elements: rebuilds drop deleted slots, old tables must be freed.
+void check_churn_memory() {
+    Map map(16);
+    for (int64_t key = 0; key < 1000; ++key) {
+        map.insert(key, Value{key, 0});
+    }
+    size_t warmedUp = 0;
+    for (int64_t key = 1000; key < 1000000; ++key) {
+        map.insert(key, Value{key, 0});
+        map.erase(key - 1000);
+        if (key == 100000) {
+            warmedUp = map.memory_usage();
+        }
+    }
+    STRESS_CHECK(map.size() == 1000);
+    STRESS_CHECK(map.memory_usage() <= warmedUp * 2);
+}
+
+}  // namespace
+
+int main() {
+    size_t threads = stress_threads();
+    Map map(16);
+    std::vector<std::unordered_map<int64_t, int64_t> > references(threads);
+    std::atomic<int64_t> hotUpdates(0);
+    std::atomic<bool> stopping(false);
+
+    // Iterates during writes and rebuilds: elements may be missed, but never torn.
+    std::thread scanner([&] {
+        while (!stopping.load()) {
+            map.for_each([](int64_t key, const Value& value) {
+                STRESS_CHECK(value.key == key);
+            });
+        }
+    });
+    run_threads(threads, [&](size_t thread) {
+        hotUpdates += run_writer(map, thread, threads, references[thread]);
+    });
+    stopping.store(true);
+    scanner.join();
+
+    size_t size = 0;
+    for (const auto& reference : references) {
+        for (const auto& [key, version] : reference) {
+            STRESS_CHECK(map.find(key) == (Value{key, version}));
+        }
+        size += reference.size();
+    }
+    int64_t hotTotal = 0;
+    for (int64_t key = 0; key < kHotKeys; ++key) {
+        std::optional<Value> value = map.find(key);
+        hotTotal += value ? value->version : 0;
+        size += value ? 1 : 0;
+    }
+    STRESS_CHECK(hotTotal == hotUpdates.load());
+    STRESS_CHECK(map.size() == size);
+
+    size_t visited = 0;
+    map.for_each([&](int64_t key, const Value& value) {
+        STRESS_CHECK(value.key == key);
+        ++visited;
+    });
+    STRESS_CHECK(visited == size);
+
+    check_churn_memory();
+    std::printf("ConcurrentHashMap stress test passed\n");
+    return 0;
+}
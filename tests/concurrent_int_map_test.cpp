@@ -0,0 +1,146 @@
+// Stress test of ConcurrentIntMap against reference maps, see stress.h.
+
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include "concurrent_int_map.h"
+#include "stress.h"
+
+using Map = ConcurrentIntMap<int64_t, int64_t>;
+
+namespace {
+
+constexpr int64_t kValueStep = 1024;  // Values of key k are k + n * kValueStep
+constexpr int64_t kHotKeys = 64;  // Keys [0, kHotKeys) are added to by all threads
+constexpr int64_t kOwnedKeys = 1 << 15;  // Owned keys per thread
+constexpr size_t kOperations = 200000;
+
+bool is_value_of(int64_t key, int64_t value) {
+    return (value - key) % kValueStep == 0;
+}
+
+/* Writes owned keys checking every result, reads keys of all threads
+ * checking their values. Returns number of additions to hot keys. */
+int64_t run_writer(Map& map, size_t thread, size_t threads, std::unordered_map<int64_t, int64_t>& reference) {
+    StressRandom random(thread);
+    int64_t hotAdds = 0;
+    for (size_t i = 0; i < kOperations; ++i) {
+        int64_t key = kHotKeys + int64_t(random.next(kOwnedKeys)) * int64_t(threads) + int64_t(thread);
+        auto it = reference.find(key);
+        switch (random.next(6)) {
+            case 0: {
+                int64_t value = key + int64_t(random.next(1000)) * kValueStep;
+                STRESS_CHECK(map.insert(key, value) == (it == reference.end()));
+                reference.emplace(key, value);
+                break;
+            }
+            case 1: {
+                int64_t value = key + int64_t(random.next(1000)) * kValueStep;
+                int64_t found = map.find_or_insert(key, value);
+                STRESS_CHECK(found == (it == reference.end() ? value : it->second));
+                reference.emplace(key, value);
+                break;
+            }
+            case 2: {
+                // Missing key counts as 0, so it gets 'key' added to be a value of the key.
+                int64_t delta = int64_t(random.next(16)) * kValueStep + (it == reference.end() ? key : 0);
+                int64_t previous = map.fetch_add(key, delta);
+                STRESS_CHECK(previous == (it == reference.end() ? 0 : it->second));
+                reference[key] += delta;
+                break;
+            }
+            case 3: {
+                int64_t guess = it == reference.end() || random.next(2) == 0 ? key : it->second;
+                int64_t expected = guess;
+                int64_t desired = key + int64_t(random.next(1000)) * kValueStep;
+                bool exchanged = map.compare_exchange(key, expected, desired);
+                STRESS_CHECK(exchanged == (it != reference.end() && it->second == guess));
+                // Failure writes the current value, or leaves 'expected' if key is missing.
+                STRESS_CHECK(expected == (it == reference.end() ? guess : it->second));
+                if (exchanged) {
+                    it->second = desired;
+                }
+                break;
+            }
+            case 4: {
+                std::optional<int64_t> found = map.find(key);
+                STRESS_CHECK(found.has_value() == (it != reference.end()));
+                STRESS_CHECK(!found || *found == it->second);
+                break;
+            }
+            default: {
+                map.fetch_add(int64_t(random.next(kHotKeys)), 1);
+                ++hotAdds;
+                // Key of another thread may be written meanwhile, but its value stays a value of it.
+                int64_t other = kHotKeys + int64_t(random.next(kOwnedKeys * threads));
+                std::optional<int64_t> found = map.find(other);
+                STRESS_CHECK(!found || is_value_of(other, *found));
+                break;
+            }
+        }
+    }
+    return hotAdds;
+}
+
+void check_reserved(Map& map) {
+    bool thrown = false;
+    try {
+        map.insert(1, Map::kUnsetValue);
+    } catch (const std::invalid_argument&) {
+        thrown = true;
+    }
+    STRESS_CHECK(thrown);
+
+    thrown = false;
+    int64_t key = -1;
+    map.insert(key, Map::kFrozenValue - 1);
+    try {
+        map.fetch_add(key, 1);
+    } catch (const std::invalid_argument&) {
+        thrown = true;
+    }
+    STRESS_CHECK(thrown);
+    STRESS_CHECK(map.find(key) == Map::kFrozenValue - 1);
+}
+
+void run(bool backgroundResize) {
+    size_t threads = stress_threads();
+    Map map(16, DefaultHash<int64_t>(), backgroundResize);
+    std::vector<std::unordered_map<int64_t, int64_t> > references(threads);
+    std::atomic<int64_t> hotAdds(0);
+
+    run_threads(threads, [&](size_t thread) {
+        hotAdds += run_writer(map, thread, threads, references[thread]);
+    });
+
+    size_t size = 0;
+    for (const auto& reference : references) {
+        for (const auto& [key, value] : reference) {
+            STRESS_CHECK(map.find(key) == value);
+        }
+        size += reference.size();
+    }
+
+    int64_t hotTotal = 0;
+    for (int64_t key = 0; key < kHotKeys; ++key) {
+        std::optional<int64_t> value = map.find(key);
+        hotTotal += value.value_or(0);
+        size += value ? 1 : 0;
+    }
+    STRESS_CHECK(hotTotal == hotAdds.load());
+    STRESS_CHECK(map.size() == size);
+
+    check_reserved(map);
+}
+
+}  // namespace
+
+int main() {
+    run(false);
+    run(true);
+    std::printf("ConcurrentIntMap stress test passed\n");
+    return 0;
+}
@@ -0,0 +1,165 @@
+// Stress test of ShardedHashMap against reference maps, see stress.h.
+
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "sharded_hash_map.h"
+#include "stress.h"
+
+namespace {
+
+// Values own heap memory, so a use of a freed shard shows under -fsanitize=address.
+using Map = ShardedHashMap<int64_t, std::string>;
+
+constexpr size_t kMaxShardSize = 64;  // Small shards split and merge all the time
+constexpr int64_t kComputedKeys = 256;  // Keys [-kComputedKeys, 0) are computed by get_or_compute()
+constexpr int64_t kOwnedKeys = 1 << 12;  // Owned keys per thread
+constexpr size_t kOperations = 200000;
+constexpr size_t kPhase = 20000;  // Operations between switches of inserting and erasing phases
+
+std::string value_of(int64_t key, int64_t version) {
+    return std::to_string(key) + ":" + std::to_string(version);
+}
+
+bool is_value_of(int64_t key, const std::string& value) {
+    std::string prefix = std::to_string(key) + ":";
+    return value.compare(0, prefix.size(), prefix) == 0;
+}
+
+/* Writes owned keys checking every result, reads keys of all threads
+ * checking their values, memoizes computed keys counting computations. */
+void run_writer(Map& map, size_t thread, size_t threads, std::unordered_map<int64_t, int64_t>& reference,
+                std::atomic<int>* computations) {
+    StressRandom random(thread);
+    int64_t version = 0;
+    for (size_t i = 0; i < kOperations; ++i) {
+        // Phases grow shards to splits and shrink them to merges.
+        bool inserting = (i / kPhase) % 2 == 0;
+        int64_t key = int64_t(random.next(kOwnedKeys)) * int64_t(threads) + int64_t(thread);
+        auto it = reference.find(key);
+        switch (random.next(6)) {
+            case 0: {
+                if (inserting) {
+                    STRESS_CHECK(map.insert(key, value_of(key, ++version)) == (it == reference.end()));
+                    reference.emplace(key, version);
+                    break;
+                }
+                [[fallthrough]];
+            }
+            case 1: {
+                STRESS_CHECK(map.erase(key) == (it != reference.end()));
+                reference.erase(key);
+                break;
+            }
+            case 2: {
+                map.insert_or_assign(key, value_of(key, ++version));
+                reference[key] = version;
+                break;
+            }
+            case 3: {
+                std::optional<std::string> found = map.find(key);
+                STRESS_CHECK(found.has_value() == (it != reference.end()));
+                STRESS_CHECK(!found || *found == value_of(key, it->second));
+                break;
+            }
+            case 4: {
+                int64_t computed = -1 - int64_t(random.next(kComputedKeys));
+                std::string value = map.get_or_compute(computed, [&] {
+                    computations[-1 - computed].fetch_add(1);
+                    return value_of(computed, 0);
+                });
+                STRESS_CHECK(value == value_of(computed, 0));
+                break;
+            }
+            default: {
+                int64_t other = int64_t(random.next(kOwnedKeys * threads));
+                std::optional<std::string> found = map.find(other);
+                STRESS_CHECK(!found || is_value_of(other, *found));
+                break;
+            }
+        }
+    }
+}
+
+/* Writes to the map from for_each(): bumps visited elements and inserts
+ * enough keys to split shards meanwhile. Every element is visited once. */
+void check_writing_for_each() {
+    Map map(kMaxShardSize);
+    constexpr int64_t kKeys = 1000;
+    for (int64_t key = 0; key < kKeys; ++key) {
+        map.insert(key, value_of(key, 0));
+    }
+    size_t visited = 0;
+    map.for_each([&](int64_t key, const std::string& value) {
+        if (key < kKeys) {
+            STRESS_CHECK(value == value_of(key, 0));
+            map.insert_or_assign(key, value_of(key, 1));
+            map.insert(key + kKeys, value_of(key + kKeys, 0));
+            ++visited;
+        }
+    });
+    STRESS_CHECK(visited == size_t(kKeys));
+    for (int64_t key = 0; key < kKeys; ++key) {
+        STRESS_CHECK(map.find(key) == value_of(key, 1));
+    }
+    STRESS_CHECK(map.size() == size_t(2 * kKeys));
+}
+
+}  // namespace
+
+int main() {
+    size_t threads = stress_threads();
+    Map map(kMaxShardSize);
+    std::vector<std::unordered_map<int64_t, int64_t> > references(threads);
+    std::vector<std::atomic<int> > computations(kComputedKeys);
+    std::atomic<bool> stopping(false);
+
+    // Walks shards during splits and merges, which must not free them meanwhile.
+    std::thread scanner([&] {
+        while (!stopping.load()) {
+            map.for_each([](int64_t key, const std::string& value) {
+                STRESS_CHECK(is_value_of(key, value));
+            });
+            STRESS_CHECK(map.memory_usage() > 0);
+            map.shrink_to_fit();
+        }
+    });
+    run_threads(threads, [&](size_t thread) {
+        run_writer(map, thread, threads, references[thread], computations.data());
+    });
+    stopping.store(true);
+    scanner.join();
+
+    size_t size = 0;
+    for (const auto& reference : references) {
+        for (const auto& [key, version] : reference) {
+            STRESS_CHECK(map.find(key) == value_of(key, version));
+        }
+        size += reference.size();
+    }
+    for (int64_t i = 0; i < kComputedKeys; ++i) {
+        // A computed key is never erased, so it is computed at most once.
+        STRESS_CHECK(computations[i].load() <= 1);
+        size += computations[i].load();
+    }
+    STRESS_CHECK(map.size() == size);
+
+    size_t visited = 0;
+    map.for_each([&](int64_t key, const std::string& value) {
+        STRESS_CHECK(is_value_of(key, value));
+        ++visited;
+    });
+    STRESS_CHECK(visited == size);
+
+    map.clear();
+    STRESS_CHECK(map.empty());
+
+    check_writing_for_each();
+    std::printf("ShardedHashMap stress test passed\n");
+    return 0;
+}
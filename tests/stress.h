@@ -0,0 +1,63 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+/* Helpers of stress tests of concurrent maps. A test builds with its
+ * header only, e.g. from this directory:
+ *
+ *     g++ -std=c++17 -O2 -pthread -I.. sharded_hash_map_test.cpp && ./a.out
+ *
+ * and is worth running with -fsanitize=thread or -fsanitize=address too.
+ * Every thread owns a part of the keys and checks each result against its
+ * own reference map, as nobody else writes those keys; other keys are
+ * shared and checked by invariants that hold under any interleaving. */
+
+// Checks condition in any build, unlike assert().
+#define STRESS_CHECK(condition)                                                            \
+    do {                                                                                   \
+        if (!(condition)) {                                                                \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            std::abort();                                                                  \
+        }                                                                                  \
+    } while (false)
+
+// Number of writer threads, more than cores to make preemption inside operations likely.
+inline size_t stress_threads() {
+    return std::max<size_t>(4, std::thread::hardware_concurrency() * 2);
+}
+
+// Runs fn(index) on 'count' threads and waits for them.
+template<class Fn>
+void run_threads(size_t count, Fn fn) {
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < count; ++i) {
+        threads.emplace_back(fn, i);
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+// Small fast generator, every thread has its own.
+class StressRandom {
+ public:
+    explicit StressRandom(uint64_t seed) : state_(seed * 0x9e3779b97f4a7c15ULL + 1) {
+    }
+
+    // Returns number in [0, bound).
+    uint64_t next(uint64_t bound) {
+        state_ ^= state_ << 13;
+        state_ ^= state_ >> 7;
+        state_ ^= state_ << 17;
+        return state_ % bound;
+    }
+
+ private:
+    uint64_t state_;
+};
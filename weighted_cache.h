@@ -0,0 +1,204 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <map>
+#include <utility>
+
+#include "hash_map.h"
+
+// Which element a WeightedCache evicts.
+enum class EvictionPolicy {
+    kLru,  // Least recently used
+    kGdsf,  // Least frequency * cost / weight, aged (Greedy Dual Size Frequency)
+};
+
+// Default weigher: memory of key and value objects themselves.
+struct SizeofWeigher {
+    template<class Key, class Value>
+    size_t operator()(const Key& /*key*/, const Value& /*value*/) const {
+        return sizeof(Key) + sizeof(Value);
+    }
+};
+
+/* Cache limited by total weight of elements, e.g. by their bytes.
+ * weigher(key, value) returns the weight of an element, it is computed
+ * once on insert. When total weight exceeds the budget, elements are evicted.
+ *
+ * With kLru, elements are kept in HashMap in order of use, and the least
+ * recently used one is evicted. With kGdsf, every element has priority
+ * L + frequency * cost / weight, where L is the priority of the last evicted
+ * element; the lowest priority is evicted. So big, cheap to load and rarely
+ * used elements go first, and old popular ones age out.
+ *
+ * Like HashMap, the cache isn't thread-safe. */
+template<class Key, class Value, class Weigher = SizeofWeigher, class Hash = DefaultHash<Key> >
+class WeightedCache {
+ public:
+    explicit WeightedCache(size_t budget, EvictionPolicy policy = EvictionPolicy::kLru,
+                           const Weigher& weigher = Weigher(), const Hash& hasher = Hash())
+            : budget_(budget), weight_(0), policy_(policy), weigher_(weigher), entries_(hasher), age_(0) {
+    }
+
+    // Returns number of elements.
+    size_t size() const {
+        return entries_.size();
+    }
+
+    bool empty() const {
+        return entries_.empty();
+    }
+
+    // Returns total weight of elements.
+    size_t weight() const {
+        return weight_;
+    }
+
+    size_t budget() const {
+        return budget_;
+    }
+
+    // Changes budget and evicts elements that don't fit in it.
+    void set_budget(size_t budget) {
+        budget_ = budget;
+        evict_to(budget_);
+    }
+
+    /* Returns pointer to value of 'key' or nullptr, counts use of element.
+     * Pointer is valid until the next change of cache. */
+    const Value* find(const Key& key) {
+        auto it = entries_.find(key);
+        if (it == entries_.end()) {
+            return nullptr;
+        }
+
+        Entry& entry = it->second;
+        if (policy_ == EvictionPolicy::kLru) {
+            entries_.move_to_end(it);
+        } else {
+            ++entry.frequency;
+            reprioritize(key, entry);
+        }
+        return &entry.value;
+    }
+
+    /* Inserts element or replaces value of 'key'. 'cost' is the price of
+     * loading the value again, it matters only for kGdsf. Evicts elements
+     * until the new one fits. Returns false if it is heavier than budget
+     * and wasn't stored. */
+    bool insert(const Key& key, const Value& value, double cost = 1.0) {
+        erase(key);
+
+        size_t weight = weigher_(key, value);
+        if (weight > budget_) {
+            return false;
+        }
+        evict_to(budget_ - weight);
+
+        Entry entry;
+        entry.value = value;
+        entry.weight = weight;
+        entry.cost = cost;
+        entry.frequency = 1;
+        entries_.insert({key, entry});
+        if (policy_ == EvictionPolicy::kGdsf) {
+            reprioritize(key, entries_.find(key)->second);
+        }
+        weight_ += weight;
+        return true;
+    }
+
+    // Deletes element with 'key'. Returns true if it was in cache.
+    bool erase(const Key& key) {
+        auto it = entries_.find(key);
+        if (it == entries_.end()) {
+            return false;
+        }
+
+        weight_ -= it->second.weight;
+        if (policy_ == EvictionPolicy::kGdsf) {
+            priorities_.erase(it->second.priority);
+        }
+        entries_.erase(key);
+        return true;
+    }
+
+    void clear() {
+        entries_.clear();
+        priorities_.clear();
+        weight_ = 0;
+        age_ = 0;
+    }
+
+    /* Returns approximate number of bytes used by cache structures, see
+     * HashMap::memory_usage(). Unlike weight(), it doesn't depend on weigher. */
+    size_t memory_usage() const {
+        // Tree node of priority queue has 3 pointers and color besides the element.
+        return sizeof(*this) + entries_.memory_usage() +
+               priorities_.size() * (sizeof(typename PriorityQueue::value_type) + 4 * sizeof(void*));
+    }
+
+    void shrink_to_fit() {
+        entries_.shrink_to_fit();
+    }
+
+    /* Evicts elements in order of eviction until memory_usage() decreases by
+     * about 'bytes', then shrinks table. Budget stays the same. */
+    void evict_memory(size_t bytes) {
+        if (entries_.empty()) {
+            return;
+        }
+        size_t perElement = std::max<size_t>(memory_usage() / entries_.size(), 1);
+        for (size_t count = (bytes + perElement - 1) / perElement; count > 0 && !entries_.empty(); --count) {
+            evict_one();
+        }
+        shrink_to_fit();
+    }
+
+ private:
+    using PriorityQueue = std::multimap<double, Key>;
+
+    struct Entry {
+        Value value;
+        size_t weight;
+        double cost;
+        size_t frequency;
+        typename PriorityQueue::iterator priority;  // Only for kGdsf
+    };
+
+    size_t budget_;
+    size_t weight_;
+    EvictionPolicy policy_;
+    Weigher weigher_;
+    HashMap<Key, Entry, Hash> entries_;  // For kLru in order of use
+
+    // For kGdsf
+    PriorityQueue priorities_;  // Keys by priority
+    double age_;  // Priority of the last evicted element, L in GDSF
+
+    // Sets priority of element by its current frequency.
+    void reprioritize(const Key& key, Entry& entry) {
+        double priority = age_ + entry.frequency * entry.cost / (entry.weight > 0 ? entry.weight : 1);
+        if (entry.frequency > 1) {
+            // Element with frequency 1 is just inserted and has no priority yet.
+            priorities_.erase(entry.priority);
+        }
+        entry.priority = priorities_.emplace(priority, key);
+    }
+
+    // Evicts elements until total weight is at most 'weight'.
+    void evict_to(size_t weight) {
+        while (weight_ > weight) {
+            evict_one();
+        }
+    }
+
+    // Evicts the least valuable element of not empty cache.
+    void evict_one() {
+        Key victim = policy_ == EvictionPolicy::kLru ? entries_.begin()->first : priorities_.begin()->second;
+        if (policy_ == EvictionPolicy::kGdsf) {
+            age_ = priorities_.begin()->first;
+        }
+        erase(victim);
+    }
+};